@@ -110,19 +110,102 @@ void ram_getsize(paddr_t *lo, paddr_t *hi);
 void		vm_map( vaddr_t, paddr_t, int );
 void		vm_unmap( vaddr_t );
 
+/*
+ * TLB management (arch/mips/vm/tlb.c, which also has vm_tlbflush).
+ *
+ * Each address space carries a struct tlbasid. Its TLB entries are
+ * tagged with the ASID in it, so switching address spaces does not
+ * require flushing the TLB. ASIDs are handed out in generations; when
+ * they run out a new generation starts and each cpu flushes its TLB
+ * the next time it activates an address space.
+ *
+ *    vm_tlbasid_init - initialize a tlbasid (no ASID assigned yet).
+ *
+ *    vm_tlbactivate - make TA's address space, with page table PT,
+ *                the one the TLB translates for on this cpu. PT is
+ *                walked directly by the UTLB refill handler; pass
+ *                NULL to send every miss to vm_fault.
+ *
+ *    vm_tlbdeactivate - forget this cpu's page table (before it goes
+ *                away) and its ASID; misses go to vm_fault. The next
+ *                vm_tlbactivate flushes the TLB.
+ *
+ *    vm_tlbload - enter the translation VADDR -> ENTRYLO for the
+ *                current address space, replacing any entry already
+ *                there for VADDR. When the TLB is full an existing
+ *                entry is evicted, so callers never run out of slots.
+ *
+ *    vm_tlbinvalidate - drop any TLB entries, on any cpu, for VADDR in
+ *                the current address space TA. Call after making a
+ *                translation less permissive or changing its frame.
+ *
+ *    vm_tlbinvalidate_all - same, for every page of TA.
+ *
+ *    vm_tlbrevoke - like vm_tlbinvalidate, but TA may be any address
+ *                space. If other cpus have to be told, the request is
+ *                added to batch TB, to go out with vm_tlbbatch_send;
+ *                if TB is NULL it is sent, and waited for, at once.
+ *
+ *    vm_tlbbatch_init - start an empty shootdown batch.
+ *
+ *    vm_tlbbatch_send - send batch TB with one IPI to each cpu it
+ *                needs to reach, wait until they have all done it,
+ *                and empty it again. The caller must not be holding
+ *                spinlocks or have interrupts off.
+ */
+struct pagetable;
+
+struct tlbasid {
+	uint32_t ta_gen;	/* generation of ta_asid; 0 if none */
+	unsigned ta_asid;	/* value for the EntryHi PID field */
+	uint32_t ta_cpus;	/* cpus that may hold entries for ta_asid */
+};
+
+void		vm_tlbasid_init(struct tlbasid *ta);
+void		vm_tlbactivate(struct tlbasid *ta, struct pagetable *pt);
+void		vm_tlbdeactivate(void);
+void		vm_tlbload(vaddr_t vaddr, uint32_t entrylo);
+void		vm_tlbinvalidate(struct tlbasid *ta, vaddr_t vaddr);
+void		vm_tlbinvalidate_all(struct tlbasid *ta);
+struct tlbbatch;
+void		vm_tlbrevoke(struct tlbasid *ta, vaddr_t vaddr,
+			     struct tlbbatch *tb);
+void		vm_tlbbatch_init(struct tlbbatch *tb);
+void		vm_tlbbatch_send(struct tlbbatch *tb);
+
+/* Page table for the UTLB refill handler, indexed by cpu number */
+extern vaddr_t cpupagetables[];
+
 
 /*
  * TLB shootdown bits.
  *
+ * A shootdown names the page by ASID and generation rather than by
+ * address space, so a request that arrives after the address space has
+ * changed ASIDs, or gone away, is harmless.
+ *
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  */
 
 struct tlbshootdown {
-	int		ts_tlb_ix;
-	unsigned	ts_cme_ix;
+	uint32_t	ts_gen;		/* ASID generation */
+	unsigned	ts_asid;	/* ASID of the entry */
+	vaddr_t		ts_vaddr;	/* page to invalidate */
 };
 
 #define TLBSHOOTDOWN_MAX 16
 
+/*
+ * Shootdowns collected to be sent together. Pages may belong to
+ * different address spaces. Once more than TLBSHOOTDOWN_MAX have been
+ * added the targets are just told to flush everything.
+ */
+struct tlbbatch {
+	struct tlbshootdown tb_pages[TLBSHOOTDOWN_MAX];
+	unsigned tb_num;		/* entries in tb_pages */
+	bool tb_all;			/* overflowed; flush instead */
+	uint32_t tb_cpus;		/* cpus to send to */
+};
+
 
 #endif /* _MIPS_VM_H_ */
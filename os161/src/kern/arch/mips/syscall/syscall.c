@@ -39,6 +39,7 @@
 #include <kern/fork.h> 
 #include <addrspace.h>
 #include <copyinout.h>
+#include "opt-dumbvm.h"
 typedef int       int32_t;
 typedef unsigned int uint32_t;
 /*
@@ -174,6 +175,31 @@ syscall(struct trapframe *tf)
 		case 309:
 		err = sys_getcpu(0,&retval);
 		break;
+#if !OPT_DUMBVM
+	    case SYS_sbrk:
+		err = sys_sbrk((intptr_t)tf->tf_a0, (vaddr_t *)&retval);
+		break;
+	    case SYS_mmap: {
+		/* fd is at sp+16; the 64-bit offset is aligned to sp+24 */
+		int fd;
+		off_t offset;
+
+		err = copyin((userptr_t)(tf->tf_sp+16), &fd, sizeof(fd));
+		if (!err) {
+			err = copyin((userptr_t)(tf->tf_sp+24), &offset,
+				     sizeof(offset));
+		}
+		if (!err) {
+			err = sys_mmap(tf->tf_a0, tf->tf_a1, tf->tf_a2,
+				       tf->tf_a3, fd, offset,
+				       (vaddr_t *)&retval);
+		}
+		break;
+	    }
+	    case SYS_munmap:
+		err = sys_munmap(tf->tf_a0, tf->tf_a1);
+		break;
+#endif
 
 /*	    
 
@@ -188,12 +214,6 @@ syscall(struct trapframe *tf)
 		err = sys_waitpid((pid_t)tf->tf_a0, (int *)tf->tf_a1, (int)tf->tf_a2,(pid_t *)&retval);
 		//kprintf("Finished waitpid\n");
 		break;
-
-
-		
-	    case SYS_sbrk:
-		err = sys_sbrk((intptr_t)tf->tf_a0, (vaddr_t *)&retval);
-		break;
 */
 	    default:
 		kprintf("Unknown syscall %d\n", callno);
@@ -37,6 +37,8 @@
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <coremap.h>
+#include <kheap.h>
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
@@ -48,29 +50,28 @@
 /* under dumbvm, always have 48k of user stack */
 #define DUMBVM_STACKPAGES    12
 
-/*
- * Wrap rma_stealmem in a spinlock.
- */
-static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
-
 void
 vm_bootstrap(void)
 {
-	/* Do nothing. */
+	coremap_bootstrap();
 }
 
+/*
+ * Physical pages come from the coremap, which falls back to
+ * ram_stealmem until vm_bootstrap has run. If it's out, see if the
+ * kernel heap has idle pages to give back.
+ */
 static
 paddr_t
-getppages(unsigned long npages)
+getppages(unsigned long npages, struct addrspace *as, vaddr_t vaddr)
 {
-	paddr_t addr;
-
-	spinlock_acquire(&stealmem_lock);
+	paddr_t pa;
 
-	addr = ram_stealmem(npages);
-	
-	spinlock_release(&stealmem_lock);
-	return addr;
+	pa = coremap_alloc(npages, as, vaddr);
+	if (pa == 0 && kheap_reclaim() > 0) {
+		pa = coremap_alloc(npages, as, vaddr);
+	}
+	return pa;
 }
 
 /* Allocate/free some kernel-space virtual pages */
@@ -78,7 +79,7 @@ vaddr_t
 alloc_kpages(int npages)
 {
 	paddr_t pa;
-	pa = getppages(npages);
+	pa = getppages(npages, NULL, 0);
 	if (pa==0) {
 		return 0;
 	}
@@ -88,22 +89,7 @@ alloc_kpages(int npages)
 void 
 free_kpages(vaddr_t addr)
 {
-	/* nothing - leak the memory. */
-
-	(void)addr;
-}
-
-void
-vm_tlbshootdown_all(void)
-{
-	panic("dumbvm tried to do tlb shootdown?!\n");
-}
-
-void
-vm_tlbshootdown(const struct tlbshootdown *ts)
-{
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	coremap_free(KVADDR_TO_PADDR(addr));
 }
 
 int
@@ -111,10 +97,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 {
 	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
 	paddr_t paddr;
-	int i;
-	uint32_t ehi, elo;
 	struct addrspace *as;
-	int spl;
 
 	faultaddress &= PAGE_FRAME;
 
@@ -178,25 +161,9 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	/* make sure it's page-aligned */
 	KASSERT((paddr & PAGE_FRAME) == paddr);
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_read(&ehi, &elo, i);
-		if (elo & TLBLO_VALID) {
-			continue;
-		}
-		ehi = faultaddress;
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-		tlb_write(ehi, elo, i);
-		splx(spl);
-		return 0;
-	}
-
-	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
-	splx(spl);
-	return EFAULT;
+	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+	vm_tlbload(faultaddress, paddr | TLBLO_DIRTY | TLBLO_VALID);
+	return 0;
 }
 
 struct addrspace *
@@ -214,6 +181,7 @@ as_create(void)
 	as->as_pbase2 = 0;
 	as->as_npages2 = 0;
 	as->as_stackpbase = 0;
+	vm_tlbasid_init(&as->as_tlb);
 
 	return as;
 }
@@ -221,24 +189,27 @@ as_create(void)
 void
 as_destroy(struct addrspace *as)
 {
+	if (as->as_pbase1 != 0) {
+		coremap_free(as->as_pbase1);
+	}
+	if (as->as_pbase2 != 0) {
+		coremap_free(as->as_pbase2);
+	}
+	if (as->as_stackpbase != 0) {
+		coremap_free(as->as_stackpbase);
+	}
 	kfree(as);
 }
 
 void
 as_activate(struct addrspace *as)
 {
-	int i, spl;
-
-	(void)as;
-
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	if (as == NULL) {
+		/* Kernel thread; leave the TLB alone. */
+		return;
 	}
-
-	splx(spl);
+	/* No page table; every miss goes to vm_fault. */
+	vm_tlbactivate(&as->as_tlb, NULL);
 }
 
 int
@@ -294,17 +265,18 @@ as_prepare_load(struct addrspace *as)
 	KASSERT(as->as_pbase2 == 0);
 	KASSERT(as->as_stackpbase == 0);
 
-	as->as_pbase1 = getppages(as->as_npages1);
+	as->as_pbase1 = getppages(as->as_npages1, as, as->as_vbase1);
 	if (as->as_pbase1 == 0) {
 		return ENOMEM;
 	}
 
-	as->as_pbase2 = getppages(as->as_npages2);
+	as->as_pbase2 = getppages(as->as_npages2, as, as->as_vbase2);
 	if (as->as_pbase2 == 0) {
 		return ENOMEM;
 	}
 
-	as->as_stackpbase = getppages(DUMBVM_STACKPAGES);
+	as->as_stackpbase = getppages(DUMBVM_STACKPAGES, as,
+		USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE);
 	if (as->as_stackpbase == 0) {
 		return ENOMEM;
 	}
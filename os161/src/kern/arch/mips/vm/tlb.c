@@ -0,0 +1,493 @@
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <thread.h>
+#include <addrspace.h>
+#include <mips/tlb.h>
+#include <platform/maxcpus.h>
+#include <vm.h>
+#include <pagetable.h>
+
+/*
+ * TLB loading and replacement, shared by dumbvm and the paged VM.
+ *
+ * After a flush the slots are handed out in order, tracked by
+ * curcpu->c_tlbnext, so filling an empty TLB never has to search for
+ * an invalid entry. Once every slot has been used the victim is
+ * picked by tlb_random(): the MIPS TLB keeps no reference bits, and
+ * random replacement does about as well as anything we could
+ * approximate in software without taking extra faults. A full TLB
+ * therefore only costs extra refills.
+ *
+ * User entries are tagged with the address space's ASID, which is
+ * also kept in the PID field of c0_entryhi; since every tlb_* call
+ * loads c0_entryhi, we always pass the current ASID along and put it
+ * back after writing invalid entries. ASID 0 is never handed out.
+ *
+ * An address space keeps its ASID until either the generation rolls
+ * over or one of its translations is revoked on a cpu other than the
+ * current one while it isn't running anywhere else; in the latter case
+ * it simply gets a fresh ASID, which makes every stale entry for it,
+ * on every cpu, unreachable.
+ *
+ * Revoking a translation of an address space that is loaded on some
+ * other cpu takes a shootdown: an IPI asking each cpu in its ta_cpus
+ * mask (the only ones that can hold entries with its ASID) to drop
+ * the entry. Only a revoke in curthread's own address space, loaded
+ * on no cpu but this one, is done purely locally; the pageout thread
+ * is a kernel thread, so its revokes always get this far. It collects
+ * them in a struct tlbbatch so that each target gets one IPI for many
+ * pages; a batch that overflows asks the targets to flush their whole
+ * TLB instead.
+ *
+ * Most user TLB misses never get here: mips_utlb_handler (in
+ * exception-mips1.S) walks the page table in cpupagetables[] itself
+ * and loads the entry with tlbwr.
+ */
+
+/* Page table for the UTLB refill handler, per cpu; 0 if none. */
+vaddr_t cpupagetables[MAXCPUS];
+
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static struct cpu *tlbcpus[MAXCPUS];	/* cpus that have used ASIDs */
+static uint32_t asid_gen = 1;		/* current generation */
+static unsigned asid_next = 1;		/* next ASID to hand out */
+
+/* counters, protected by asid_lock */
+static unsigned tlb_nactivates;		/* address space switches */
+static unsigned tlb_nflushes;		/* ...that had to flush */
+static unsigned tlb_navoided;		/* ...that kept the TLB */
+static unsigned tlb_nrollovers;		/* generations used up */
+static unsigned tlb_nreassigns;		/* ASIDs dropped to revoke entries */
+static unsigned tlb_nbatches;		/* shootdown batches sent */
+static unsigned tlb_nipis;		/* ...IPIs they took */
+static unsigned tlb_npages;		/* ...pages they carried */
+static unsigned tlb_nfullflushes;	/* ...that overflowed to flushes */
+
+#define CPUBIT(c) ((uint32_t)1 << (c)->c_number)
+#define ENTRYHI(va, asid) \
+	(((va) & TLBHI_VPAGE) | ((uint32_t)(asid) << TLBHI_PIDSHIFT))
+
+void
+vm_tlbflush(void)
+{
+	int i, spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	curcpu->c_tlbnext = 0;
+	tlb_setentryhi(ENTRYHI(0, curcpu->c_tlbasid));
+
+	splx(spl);
+}
+
+void
+vm_tlbload(vaddr_t vaddr, uint32_t entrylo)
+{
+	uint32_t entryhi;
+	int i, spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	entryhi = ENTRYHI(vaddr, curcpu->c_tlbasid);
+
+	i = tlb_probe(entryhi, 0);
+	if (i >= 0) {
+		/* e.g. upgrading a read-only entry after copy-on-write */
+		tlb_write(entryhi, entrylo, i);
+	}
+	else if (curcpu->c_tlbnext < NUM_TLB) {
+		tlb_write(entryhi, entrylo, curcpu->c_tlbnext++);
+	}
+	else {
+		tlb_random(entryhi, entrylo);
+	}
+
+	splx(spl);
+}
+
+////////////////////////////////////////////////////////////
+
+void
+vm_tlbasid_init(struct tlbasid *ta)
+{
+	ta->ta_gen = 0;
+	ta->ta_asid = 0;
+	ta->ta_cpus = 0;
+}
+
+/*
+ * Give TA a new ASID, starting a new generation if they're used up.
+ * Call with asid_lock held.
+ */
+static
+void
+asid_assign(struct tlbasid *ta)
+{
+	KASSERT(spinlock_do_i_hold(&asid_lock));
+
+	if (asid_next == NUM_ASID) {
+		asid_gen++;
+		asid_next = 1;
+		tlb_nrollovers++;
+	}
+	ta->ta_asid = asid_next++;
+	ta->ta_gen = asid_gen;
+	ta->ta_cpus = 0;
+}
+
+/*
+ * Switch this cpu to TA's ASID.
+ */
+static
+void
+tlb_activate_asid(struct tlbasid *ta)
+{
+	bool flush;
+	int spl;
+
+	spl = splhigh();
+
+	KASSERT(curcpu->c_number < 32);
+
+	spinlock_acquire(&asid_lock);
+	if (ta->ta_gen != asid_gen) {
+		asid_assign(ta);
+	}
+	ta->ta_cpus |= CPUBIT(curcpu);
+
+	/* Entries from an older generation may share ASIDs with ours. */
+	flush = curcpu->c_tlbgen != asid_gen;
+	curcpu->c_tlbgen = asid_gen;
+
+	curcpu->c_tlbasid = ta->ta_asid;
+	tlbcpus[curcpu->c_number] = curcpu->c_self;
+
+	tlb_nactivates++;
+	if (flush) {
+		tlb_nflushes++;
+	}
+	else {
+		tlb_navoided++;
+	}
+	spinlock_release(&asid_lock);
+
+	if (flush) {
+		vm_tlbflush();
+	}
+	else {
+		tlb_setentryhi(ENTRYHI(0, ta->ta_asid));
+	}
+
+	splx(spl);
+}
+
+void
+vm_tlbactivate(struct tlbasid *ta, struct pagetable *pt)
+{
+	int spl;
+
+	/* The refill handler hardwires the page table layout. */
+	COMPILE_ASSERT(PT_NENTRIES == 1024);
+	COMPILE_ASSERT(PTE_VALID == TLBLO_VALID);
+	COMPILE_ASSERT(PTE_NOREF == 0x2);
+
+	spl = splhigh();
+	cpupagetables[curcpu->c_number] = (vaddr_t)pt;
+	tlb_activate_asid(ta);
+	splx(spl);
+}
+
+void
+vm_tlbdeactivate(void)
+{
+	int spl;
+
+	spl = splhigh();
+	cpupagetables[curcpu->c_number] = 0;
+
+	/*
+	 * Run with the never-assigned ASID 0, so nothing can reach the
+	 * entries still in the TLB, and so that nobody mistakes this
+	 * cpu for one running the old address space. Forgetting the
+	 * generation makes the next activation flush them.
+	 */
+	spinlock_acquire(&asid_lock);
+	curcpu->c_tlbasid = 0;
+	curcpu->c_tlbgen = 0;
+	spinlock_release(&asid_lock);
+	tlb_setentryhi(ENTRYHI(0, 0));
+
+	splx(spl);
+}
+
+void
+vm_tlbinvalidate(struct tlbasid *ta, vaddr_t vaddr)
+{
+	bool local;
+	int i, spl;
+
+	spl = splhigh();
+
+	KASSERT(curcpu->c_tlbasid == ta->ta_asid);
+
+	spinlock_acquire(&asid_lock);
+	local = ta->ta_gen == asid_gen && ta->ta_cpus == CPUBIT(curcpu);
+	if (!local) {
+		ta->ta_gen = 0;
+		tlb_nreassigns++;
+	}
+	spinlock_release(&asid_lock);
+
+	if (local) {
+		/* Only this cpu can have entries; just drop ours. */
+		i = tlb_probe(ENTRYHI(vaddr, ta->ta_asid), 0);
+		if (i >= 0) {
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+			tlb_setentryhi(ENTRYHI(0, ta->ta_asid));
+		}
+	}
+	else {
+		tlb_activate_asid(ta);
+	}
+
+	splx(spl);
+}
+
+void
+vm_tlbinvalidate_all(struct tlbasid *ta)
+{
+	int spl;
+
+	spl = splhigh();
+
+	KASSERT(curcpu->c_tlbasid == ta->ta_asid);
+
+	spinlock_acquire(&asid_lock);
+	ta->ta_gen = 0;
+	tlb_nreassigns++;
+	spinlock_release(&asid_lock);
+
+	tlb_activate_asid(ta);
+
+	splx(spl);
+}
+
+/*
+ * Drop this cpu's entry, if any, for VADDR with ASID from generation
+ * GEN. Call at splhigh.
+ */
+static
+void
+tlb_drop(uint32_t gen, unsigned asid, vaddr_t vaddr)
+{
+	int i;
+
+	if (curcpu->c_tlbgen != gen) {
+		/* Our TLB holds nothing from that generation. */
+		return;
+	}
+	i = tlb_probe(ENTRYHI(vaddr, asid), 0);
+	if (i >= 0) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	tlb_setentryhi(ENTRYHI(0, curcpu->c_tlbasid));
+}
+
+/*
+ * Revoke VADDR in TA, which need not be the current address space,
+ * e.g. for pageout.
+ */
+void
+vm_tlbrevoke(struct tlbasid *ta, vaddr_t vaddr, struct tlbbatch *tb)
+{
+	struct tlbbatch mytb;
+	struct tlbshootdown *ts;
+	struct cpu *c;
+	uint32_t gen, targets;
+	bool loaded;
+	unsigned i;
+	int spl;
+
+	if (ta->ta_gen == 0) {
+		/* No ASID, so no reachable entries anywhere. */
+		return;
+	}
+
+	spl = splhigh();
+
+	spinlock_acquire(&asid_lock);
+	if (curthread->t_addrspace != NULL &&
+	    ta == &curthread->t_addrspace->as_tlb &&
+	    ta->ta_gen == asid_gen && ta->ta_cpus == CPUBIT(curcpu)) {
+		/*
+		 * Our own address space, and it has never been loaded
+		 * on any other cpu in this generation, so only our TLB
+		 * can hold the entry. Merely having the same ASID in
+		 * c_tlbasid proves nothing: it may be left over from
+		 * before a switch to a kernel thread, while the address
+		 * space now runs on another cpu.
+		 */
+		gen = ta->ta_gen;
+		spinlock_release(&asid_lock);
+		tlb_drop(gen, ta->ta_asid, vaddr);
+		splx(spl);
+		return;
+	}
+
+	loaded = false;
+	for (i=0; i<MAXCPUS; i++) {
+		c = tlbcpus[i];
+		if (c != NULL && c->c_tlbgen == ta->ta_gen &&
+		    c->c_tlbasid == ta->ta_asid) {
+			loaded = true;
+			break;
+		}
+	}
+	if (!loaded) {
+		/* Not loaded anywhere; a new ASID hides the old entries. */
+		ta->ta_gen = 0;
+		tlb_nreassigns++;
+		spinlock_release(&asid_lock);
+		splx(spl);
+		return;
+	}
+	gen = ta->ta_gen;
+	targets = ta->ta_cpus & ~CPUBIT(curcpu);
+	spinlock_release(&asid_lock);
+
+	/* We may have entries for it from before, too. */
+	tlb_drop(gen, ta->ta_asid, vaddr);
+
+	splx(spl);
+
+	if (targets == 0) {
+		return;
+	}
+
+	if (tb == NULL) {
+		tb = &mytb;
+		vm_tlbbatch_init(tb);
+	}
+	if (tb->tb_num < TLBSHOOTDOWN_MAX) {
+		ts = &tb->tb_pages[tb->tb_num++];
+		ts->ts_gen = gen;
+		ts->ts_asid = ta->ta_asid;
+		ts->ts_vaddr = vaddr;
+	}
+	else {
+		tb->tb_all = true;
+	}
+	tb->tb_cpus |= targets;
+
+	if (tb == &mytb) {
+		vm_tlbbatch_send(tb);
+	}
+}
+
+void
+vm_tlbbatch_init(struct tlbbatch *tb)
+{
+	tb->tb_num = 0;
+	tb->tb_all = false;
+	tb->tb_cpus = 0;
+}
+
+void
+vm_tlbbatch_send(struct tlbbatch *tb)
+{
+	unsigned tickets[MAXCPUS];
+	unsigned i, nipis;
+
+	if (tb->tb_cpus == 0) {
+		vm_tlbbatch_init(tb);
+		return;
+	}
+
+	nipis = 0;
+	for (i=0; i<MAXCPUS; i++) {
+		if (tb->tb_cpus & ((uint32_t)1 << i)) {
+			KASSERT(tlbcpus[i] != NULL);
+			tickets[i] = ipi_tlbshootdown(tlbcpus[i],
+				tb->tb_all ? NULL : tb->tb_pages,
+				tb->tb_all ? 0 : tb->tb_num);
+			nipis++;
+		}
+	}
+
+	spinlock_acquire(&asid_lock);
+	tlb_nbatches++;
+	tlb_nipis += nipis;
+	tlb_npages += tb->tb_num;
+	if (tb->tb_all) {
+		tlb_nfullflushes++;
+	}
+	spinlock_release(&asid_lock);
+
+	/* The frames may be reused as soon as we return. */
+	for (i=0; i<MAXCPUS; i++) {
+		if (tb->tb_cpus & ((uint32_t)1 << i)) {
+			ipi_tlbshootdown_wait(tlbcpus[i], tickets[i]);
+		}
+	}
+
+	vm_tlbbatch_init(tb);
+}
+
+/*
+ * Shootdown handlers, called from interprocessor_interrupt.
+ */
+
+void
+vm_tlbshootdown_all(void)
+{
+	vm_tlbflush();
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	int spl;
+
+	spl = splhigh();
+	tlb_drop(ts->ts_gen, ts->ts_asid, ts->ts_vaddr);
+	splx(spl);
+}
+
+void
+vm_tlbprintstats(void)
+{
+	unsigned nactivates, nflushes, navoided, nrollovers, nreassigns;
+	unsigned nbatches, nipis, npages, nfullflushes;
+	uint32_t gen;
+
+	spinlock_acquire(&asid_lock);
+	nactivates = tlb_nactivates;
+	nflushes = tlb_nflushes;
+	navoided = tlb_navoided;
+	nrollovers = tlb_nrollovers;
+	nreassigns = tlb_nreassigns;
+	nbatches = tlb_nbatches;
+	nipis = tlb_nipis;
+	npages = tlb_npages;
+	nfullflushes = tlb_nfullflushes;
+	gen = asid_gen;
+	spinlock_release(&asid_lock);
+
+	kprintf("tlb: %u address space switches\n", nactivates);
+	kprintf("tlb: %u full flushes, %u flushes avoided\n",
+		nflushes, navoided);
+	kprintf("tlb: ASID generation %u, %u rollovers, %u reassignments\n",
+		gen, nrollovers, nreassigns);
+	kprintf("tlb: %u shootdown batches: %u IPIs, %u pages, "
+		"%u overflowed to full flushes\n",
+		nbatches, nipis, npages, nfullflushes);
+}
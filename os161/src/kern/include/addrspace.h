@@ -36,20 +36,44 @@
 
 
 #include <vm.h>
+#include <array.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct pagetable;
 
 
+/*
+ * A region is a range of pages of an address space defined by
+ * as_define_region (or as_define_stack, or the sbrk heap), with the
+ * permissions the executable asked for.
+ */
+struct region {
+	vaddr_t rg_vbase;		/* page-aligned start */
+	size_t rg_npages;		/* length in pages */
+	unsigned rg_flags;		/* RG_* */
+	struct vnode *rg_vnode;		/* file mapped, or NULL if anonymous */
+	off_t rg_offset;		/* file offset of rg_vbase */
+	size_t rg_filesz;		/* bytes from the file; rest is zeros */
+};
+
+#define RG_READ		0x1
+#define RG_WRITE	0x2
+#define RG_EXEC		0x4
+#define RG_MMAP		0x8		/* made by mmap; can be unmapped */
+#define RG_STACK	0x10		/* grows down on faults below it */
+
+#ifndef ASINLINE
+#define ASINLINE INLINE
+#endif
+
+DECLARRAY(region, ASINLINE);
+DEFARRAY(region, ASINLINE);
+
 /*
  * Address space - data structure associated with the virtual memory
  * space of a process.
- *
- * You write this.
  */
-struct pageTableEntry {
-  paddr_t frameAddr;
-};
 struct addrspace {
 #if OPT_DUMBVM
         vaddr_t as_vbase1;
@@ -59,19 +83,15 @@ struct addrspace {
         paddr_t as_pbase2;
         size_t as_npages2;
         paddr_t as_stackpbase;
-
-        /* Put stuff here for your VM system */
-  bool as_load_complete;
-  struct pageTableEntry *as_pgTable1;
-  struct pageTableEntry *as_pgTable2;
-  struct pageTableEntry *as_pgStackTable;         
 #else
-        /* Put stuff here for your VM system */
-  bool as_load_complete;
-  struct pageTableEntry *as_pgTable1;
-  struct pageTableEntry *as_pgTable2;
-  struct pageTableEntry *as_pgStackTable;        
+	struct regionarray as_regions;	/* defined regions */
+	struct region as_heap;		/* sbrk heap, above the executable */
+	vaddr_t as_break;		/* current break (end of heap) */
+	struct pagetable *as_pt;	/* page table */
+	bool as_load_complete;		/* false while load_elf runs */
+	struct addrspace *as_next;	/* list of all address spaces */
 #endif
+	struct tlbasid as_tlb;		/* TLB address space ID */
 };
 
 /*
@@ -101,6 +121,16 @@ struct addrspace {
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
+ *    as_define_file - like as_define_region, but the first FILESZ
+ *                bytes come from file VN starting at OFFSET (which
+ *                must have the same offset within a page as VADDR),
+ *                read in as the pages are first touched; the rest is
+ *                zero-filled. Whole pages of file data go through the
+ *                page cache, so they are shared with other processes
+ *                mapping the same file. load_elf does not load such
+ *                regions. The region takes its own reference to VN.
+ *                (Not available with dumbvm.)
+ *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
@@ -111,6 +141,32 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_find_region - return the region containing a given address, or
+ *                NULL. (Not available with dumbvm.)
+ *
+ *    as_growstack - extend the stack down to cover VADDR, if VADDR is
+ *                within PROC_MAX_STACK_PAGES of USERSTACK and nothing
+ *                else is in the way, and return the stack region;
+ *                otherwise return NULL. No pages are allocated.
+ *                (Not available with dumbvm.)
+ *
+ *    as_sbrk   - move the heap break by AMOUNT bytes, which may be
+ *                negative, and hand back the old break. Pages beyond a
+ *                lowered break are freed at once. (Not available with
+ *                dumbvm.)
+ *
+ *    as_mmap   - map LEN bytes of file VN from OFFSET, with region
+ *                flags FLAGS, at an address of our choosing, handed
+ *                back in RET. The region takes its own reference to
+ *                VN. (Not available with dumbvm.)
+ *
+ *    as_munmap - remove the mapping made by as_mmap at VADDR. LEN must
+ *                cover the whole mapping. (Not available with dumbvm.)
+ *
+ *    as_findowner - return the address space whose page table maps
+ *                frame PA at VADDR, or NULL. Call with the paging lock
+ *                held. (Not available with dumbvm.)
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -126,9 +182,23 @@ int               as_define_region(struct addrspace *as,
                                    int readable,
                                    int writeable,
                                    int executable);
+int               as_define_file(struct addrspace *as,
+                                 vaddr_t vaddr, size_t sz, size_t filesz,
+                                 int readable,
+                                 int writeable,
+                                 int executable,
+                                 struct vnode *vn, off_t offset);
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+struct region    *as_find_region(struct addrspace *as, vaddr_t vaddr);
+struct region    *as_growstack(struct addrspace *as, vaddr_t vaddr);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
+int               as_mmap(struct addrspace *as, size_t len, unsigned flags,
+                          struct vnode *vn, off_t offset, vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+struct addrspace *as_findowner(paddr_t pa, vaddr_t vaddr);
 
 
 /*
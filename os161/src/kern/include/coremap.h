@@ -0,0 +1,156 @@
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+/*
+ * Physical page tracking ("coremap").
+ *
+ * The coremap has one entry for every physical page frame of RAM,
+ * indexed by physical page number. It is built by coremap_bootstrap()
+ * from the memory left over after the early boot allocations done
+ * with ram_stealmem(), and from then on it is the only source of
+ * physical pages for both the kernel heap and user address spaces.
+ *
+ * Free memory is managed as a binary buddy system: free blocks of
+ * 2^k pages, aligned to 2^k pages, are kept on one list per order k.
+ *
+ * In front of that, each CPU keeps a small cache of free single pages
+ * (struct coremap_pcpu, in struct cpu). Single-page allocations and
+ * frees normally touch only the local cache, with interrupts off;
+ * the shared buddy lists are only locked to refill or drain a cache
+ * in batches.
+ *
+ * Functions:
+ *     coremap_bootstrap  - build the coremap. Called from vm_bootstrap.
+ *     coremap_alloc      - allocate NPAGES physically contiguous pages.
+ *                          AS and VADDR record the user mapping for
+ *                          user pages; pass NULL and 0 for kernel pages.
+ *                          User pages are returned pinned.
+ *                          Returns 0 if no memory is available.
+ *     coremap_alloc_zeroed - allocate a single page, like coremap_alloc,
+ *                          from the pool of pages already filled with
+ *                          zeros. Returns 0 if the pool is empty.
+ *     coremap_zerofill   - clear a free page and add it to the zero
+ *                          pool. Returns false if the pool is full or
+ *                          memory is. For the page zeroing thread.
+ *     coremap_zeropages  - return the number of pages in the pool.
+ *     coremap_free       - release a run previously returned by
+ *                          coremap_alloc, given its first page. For a
+ *                          shared page, just drops one reference.
+ *                          Pages stolen before coremap_bootstrap are
+ *                          never freed; this does nothing for them.
+ *     coremap_incref     - take an extra reference to a single user
+ *                          page (for copy-on-write sharing), for a
+ *                          mapping at VADDR.
+ *     coremap_refcount   - return the number of references to a page.
+ *     coremap_setowner   - record the single address space mapping a
+ *                          formerly shared user page.
+ *     coremap_adopt      - likewise, but only if the page is down to
+ *                          one reference and has no owner yet.
+ *     coremap_victim     - advance the clock hand to the next user
+ *                          page that could be paged out, and pin it.
+ *                          Its owner may be unknown (NULL) if it was
+ *                          shared until lately.
+ *     coremap_pin        - keep a user page from being paged out
+ *                          for a while.
+ *     coremap_unpin      - allow a user page to be paged out. User
+ *                          pages start out pinned.
+ *     coremap_swapslot   - return the swap slot recorded for a user
+ *                          page whose contents are also in swap, or
+ *                          CME_NONE.
+ *     coremap_setswapslot - record (or, with CME_NONE, forget) such a
+ *                          slot. Must be forgotten before the page is
+ *                          freed or shared.
+ *     coremap_heapref    - return the pointer kmalloc recorded for a
+ *                          kernel heap page, or NULL if none.
+ *                          Lock-free.
+ *     coremap_setheapref - record such a pointer; NULL clears it.
+ *                          Ignored before the coremap exists.
+ *     coremap_freepages  - return the number of free frames.
+ *     coremap_totalpages - return the number of frames in the coremap.
+ *     coremap_pcpu_init  - set up a CPU's page cache. Called from
+ *                          cpu_create.
+ *     coremap_printstats - print page usage counters.
+ */
+
+#include <spinlock.h>
+#include <vm.h>
+
+struct addrspace;
+
+/* Page states */
+#define CME_FREE	0	/* on the free list */
+#define CME_FIXED	1	/* kernel image and early boot memory */
+#define CME_KERNEL	2	/* kernel heap page */
+#define CME_USER	3	/* user page */
+#define CME_CACHED	4	/* free, in a per-cpu page cache */
+#define CME_ZEROED	5	/* free and cleared, in the zero pool */
+
+/* No index; terminates the free lists. Also "no swap slot". */
+#define CME_NONE	0xffffffff
+
+/* Buddy orders 0 .. COREMAP_NORDERS-1; the largest block is 4M */
+#define COREMAP_NORDERS	11
+
+/* cme_order of a page that is not the head of a free block */
+#define CME_NOORDER	0xff
+
+struct coremap_entry {
+	struct addrspace *cme_as;	/* owning address space, if unshared */
+	vaddr_t cme_vaddr;		/* user address it is mapped at, or 0 */
+	unsigned cme_npages;		/* length of run (first page only) */
+	unsigned cme_refcount;		/* mappings sharing the page */
+	unsigned cme_next;		/* free list links (free block heads) */
+	unsigned cme_prev;
+	unsigned char cme_state;	/* CME_* */
+	unsigned char cme_order;	/* block order (free block heads) */
+	unsigned cme_swapslot;		/* copy in swap if clean, or CME_NONE */
+	unsigned char cme_pinned;	/* user page not to be paged out */
+	void *cme_heapref;		/* kmalloc bookkeeping, heap pages */
+};
+
+/* Pages kept pre-zeroed for first-touch faults */
+#define COREMAP_ZEROPAGES	16
+
+/* Per-cpu page cache sizing */
+#define COREMAP_PCPU_PAGES	16	/* capacity */
+#define COREMAP_PCPU_BATCH	8	/* pages moved per refill/drain */
+
+struct coremap_pcpu {
+	struct coremap_pcpu *cp_next;	/* all caches */
+	struct spinlock cp_lock;	/* protects everything below */
+	unsigned cp_count;		/* pages in cp_pages[] */
+	paddr_t cp_pages[COREMAP_PCPU_PAGES];
+
+	/* counters */
+	unsigned cp_hits;		/* allocations served locally */
+	unsigned cp_misses;		/* allocations that had to refill */
+	unsigned cp_refills;
+	unsigned cp_drains;
+	int cp_nkernel;			/* net kernel pages handed out */
+	int cp_nuser;			/* net user pages handed out */
+};
+
+void coremap_bootstrap(void);
+void coremap_pcpu_init(struct coremap_pcpu *cp);
+paddr_t coremap_alloc(unsigned long npages, struct addrspace *as,
+		      vaddr_t vaddr);
+paddr_t coremap_alloc_zeroed(struct addrspace *as, vaddr_t vaddr);
+bool coremap_zerofill(void);
+unsigned coremap_zeropages(void);
+void coremap_free(paddr_t paddr);
+void coremap_incref(paddr_t paddr, vaddr_t vaddr);
+unsigned coremap_refcount(paddr_t paddr);
+void coremap_setowner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+void coremap_adopt(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+paddr_t coremap_victim(struct addrspace **as_ret, vaddr_t *vaddr_ret);
+void coremap_pin(paddr_t paddr);
+void coremap_unpin(paddr_t paddr);
+unsigned coremap_swapslot(paddr_t paddr);
+void coremap_setswapslot(paddr_t paddr, unsigned slot);
+void *coremap_heapref(paddr_t paddr);
+void coremap_setheapref(paddr_t paddr, void *ref);
+unsigned coremap_freepages(void);
+unsigned coremap_totalpages(void);
+void coremap_printstats(void);
+
+#endif /* _COREMAP_H_ */
@@ -34,6 +34,8 @@
 #include <spinlock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include <coremap.h>     /* for struct coremap_pcpu */
+#include <kheap.h>       /* for struct kheap_pcpu */
 
 
 /*
@@ -61,6 +63,11 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned char c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	struct coremap_pcpu c_pagecache; /* Free pages (own lock) */
+	struct kheap_pcpu c_heapcache;	/* Free heap blocks (ditto) */
+	unsigned c_tlbnext;		/* TLB slots filled since last flush */
+	uint32_t c_tlbgen;		/* ASID generation of TLB contents */
+	unsigned c_tlbasid;		/* ASID currently in EntryHi */
 
 	/*
 	 * Accessed by other cpus.
@@ -82,10 +89,16 @@ struct cpu {
 	 * The contents of struct tlbshootdown are also machine-
 	 * dependent and might reasonably be either an address space
 	 * and vaddr pair, or a paddr, or something else.
+	 *
+	 * c_shootdown_seq counts shootdown IPIs sent to this CPU, and
+	 * c_shootdown_done is the count it has handled, so senders can
+	 * wait for theirs to complete.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	unsigned c_shootdown_seq;	/* shootdowns requested */
+	unsigned c_shootdown_done;	/* shootdowns handled */
 	struct spinlock c_ipi_lock;
 
 	/*
@@ -155,7 +168,10 @@ void cpu_halt(void);
  *
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
- * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data, a
+ * whole batch of it at once. It returns a ticket that can be passed
+ * to ipi_tlbshootdown_wait to wait until the target has done the
+ * invalidations.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -169,7 +185,9 @@ void cpu_halt(void);
 
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
-void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown(struct cpu *target,
+			  const struct tlbshootdown *mappings, unsigned n);
+void ipi_tlbshootdown_wait(struct cpu *target, unsigned ticket);
 
 void interprocessor_interrupt(void);
 
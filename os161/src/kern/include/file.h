@@ -24,6 +24,11 @@ bool		file_descriptor_exists( struct proc *, int );
 void		des_file( struct file * );
 int		close_all_f( struct proc * );
 
+//struct file objects come from their own object cache.
+void		file_bootstrap( void );
+struct file	*file_alloc( void );
+void		file_free( struct file * );
+
 
 //helper function to open() files from inside the kernel.
 int		k_open( struct proc *, char *, int, int *);
@@ -0,0 +1,21 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Definitions for mmap() and munmap().
+ */
+
+/* Page protections (PROT_*), ORed together */
+#define PROT_NONE	0
+#define PROT_READ	1
+#define PROT_WRITE	2
+#define PROT_EXEC	4
+
+/* Mapping types (MAP_*); exactly one must be given */
+#define MAP_SHARED	1	/* share the file's pages */
+#define MAP_PRIVATE	2	/* copy on write */
+
+/* Error return from mmap() */
+#define MAP_FAILED	((void *)-1)
+
+#endif /* _KERN_MMAN_H_ */
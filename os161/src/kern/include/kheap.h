@@ -0,0 +1,98 @@
+#ifndef _KHEAP_H_
+#define _KHEAP_H_
+
+/*
+ * Kernel heap (kmalloc) internals shared with the rest of the kernel.
+ * The kmalloc interface itself is in <lib.h>.
+ *
+ * Each CPU keeps a small cache of free blocks of every subpage size
+ * (struct kheap_pcpu, in struct cpu). Small kmalloc and kfree calls
+ * normally touch only the local cache, under its own lock, which no
+ * other CPU takes except to empty the cache in kheap_reclaim; the
+ * shared heap pages are only locked to refill or drain a cache in
+ * batches. Blocks sitting in a cache count as allocated as far as
+ * their heap page is concerned.
+ *
+ * Object caches hold objects of one type, exactly fitted to its size
+ * rather than rounded up to a kmalloc block size. An optional
+ * constructor runs when an object is first carved out of a page, and
+ * the destructor only when that page is given back; in between, the
+ * object goes round and round in its constructed state. So a freed
+ * object must be handed back the way the constructor left it (e.g.
+ * with its locks released and its wait channels empty).
+ *
+ * One allocation in every few dozen, picked at random, has its call
+ * site recorded by the heap profiler until it is freed, so that the
+ * live heap can be broken down by where it was allocated (see
+ * kheap_profile in <lib.h>). The countdown to the next sample is kept
+ * per CPU too.
+ *
+ * A heap page whose blocks are all free is kept for reuse, up to a
+ * few per block size; any beyond that go back to the page allocator
+ * straight away, and the VM system can call kheap_reclaim to get the
+ * rest back when free memory runs low.
+ *
+ * Functions:
+ *     kheap_bootstrap - start finding heap pages through the coremap.
+ *                       Called from coremap_bootstrap.
+ *     kheap_pcpu_init - set up a CPU's block cache. Called from
+ *                       cpu_create.
+ *     kheap_reclaim   - give back all heap pages with nothing allocated
+ *                       on them, after emptying every CPU's block cache.
+ *                       Returns the number of pages freed. Called
+ *                       by the VM system when memory runs low.
+ *
+ *     kmem_cache_create - make a cache for objects of SIZE bytes.
+ *                       NAME is shown in kheap_printstats and should
+ *                       be a string constant. CTOR, if not NULL,
+ *                       constructs an object and returns 0 or an
+ *                       error code; DTOR, if not NULL, undoes it.
+ *                       Returns NULL if out of memory.
+ *     kmem_cache_destroy - destroy a cache with no objects in use.
+ *     kmem_cache_alloc - return a constructed object, or NULL if out
+ *                       of memory. May call CTOR, so don't hold
+ *                       spinlocks if CTOR might sleep.
+ *     kmem_cache_free  - give back an object from kmem_cache_alloc.
+ *                       May call DTOR.
+ */
+
+#include <spinlock.h>
+
+/* Number of subpage block sizes; must cover sizes[] in kmalloc.c */
+#define KHEAP_NSIZES		8
+
+/* Per-cpu block cache sizing, per block size */
+#define KHEAP_PCPU_BLOCKS	16	/* capacity */
+#define KHEAP_PCPU_BATCH	8	/* blocks moved per refill/drain */
+
+struct kheap_pcpu {
+	struct kheap_pcpu *kp_next;	/* all caches */
+	struct spinlock kp_lock;	/* protects blocks and counters */
+	unsigned kp_count[KHEAP_NSIZES];	/* blocks in kp_blocks[] */
+	void *kp_blocks[KHEAP_NSIZES][KHEAP_PCPU_BLOCKS];
+
+	/* counters */
+	unsigned kp_hits;		/* allocations served locally */
+	unsigned kp_misses;		/* allocations that had to refill */
+	unsigned kp_refills;
+	unsigned kp_drains;
+
+	/* allocation profiler sampling; only touched by the owning cpu */
+	unsigned kp_sampleskip;		/* allocations until the next sample */
+	uint32_t kp_samplerand;		/* random state for the skip length */
+};
+
+void kheap_bootstrap(void);
+void kheap_pcpu_init(struct kheap_pcpu *kp);
+unsigned kheap_reclaim(void);
+
+struct kmem_cache;	/* Opaque */
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     int (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+void kmem_cache_destroy(struct kmem_cache *kc);
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+
+#endif /* _KHEAP_H_ */
@@ -125,10 +125,17 @@ uint32_t random(void);
  *
  * kheap_nextgeneration, dump, and dumpall do nothing unless heap
  * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
+ *
+ * kheap_profile prints the live heap by allocation site, as estimated
+ * from the sampled allocations; this is always available.
+ * kheap_setprofrate sets the average number of allocations per sample
+ * (0 turns sampling off) and starts a fresh profile.
  */
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
+void kheap_profile(void);
+void kheap_setprofrate(unsigned rate);
 void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
@@ -0,0 +1,56 @@
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+/*
+ * Page cache for file-backed mappings.
+ *
+ * Records which frame holds each page of a mapped file, keyed by
+ * vnode and page-aligned file offset, so that every mapping of the
+ * same file page shares one frame. A frame stays in the cache for as
+ * long as some page table maps it (such entries have PTE_FILE set);
+ * the cache holds no reference of its own to either the frame or the
+ * vnode.
+ *
+ * Cached frames must match the file. Anything that writes to a file
+ * through the file system must therefore call vm_filewritten for the
+ * range afterwards; it reads the cached pages of that range again in
+ * place. sys_write does so. Swap, which is never mapped, doesn't need
+ * to.
+ *
+ * All functions must be called with the VM paging lock held.
+ *
+ * Functions:
+ *     pagecache_lookup   - return the entry for page OFFSET of VN, or
+ *                          NULL.
+ *     pagecache_bypaddr  - return the entry for frame PADDR, or NULL.
+ *     pagecache_insert   - add an entry and return it, marked busy
+ *                          (being read in). Returns NULL if out of
+ *                          memory.
+ *     pagecache_remove   - remove an entry and free it.
+ *     pagecache_printstats - print lookup counters.
+ */
+
+#include <vm.h>
+
+struct vnode;
+
+struct pcentry {
+	struct vnode *pc_vnode;
+	off_t pc_offset;		/* page-aligned offset in file */
+	paddr_t pc_paddr;		/* frame holding the page */
+	bool pc_busy;			/* being read in */
+	struct pcentry *pc_next;	/* hash chain by vnode and offset */
+	struct pcentry *pc_pnext;	/* hash chain by frame */
+};
+
+/* Buckets in each of the two hash tables */
+#define PAGECACHE_NBUCKETS	128
+
+struct pcentry *pagecache_lookup(struct vnode *vn, off_t offset);
+struct pcentry *pagecache_bypaddr(paddr_t paddr);
+struct pcentry *pagecache_insert(struct vnode *vn, off_t offset,
+				 paddr_t paddr);
+void pagecache_remove(struct pcentry *pce);
+void pagecache_printstats(void);
+
+#endif /* _PAGECACHE_H_ */
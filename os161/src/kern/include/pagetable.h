@@ -0,0 +1,83 @@
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Two-level user page tables.
+ *
+ * A user virtual address is split 10/10/12: the top 10 bits index the
+ * page directory, the next 10 bits index a second-level table, and
+ * the low 12 bits are the offset in the page. The directory and each
+ * second-level table are exactly one page; second-level tables are
+ * only allocated for 4M stretches of the address space that are
+ * actually in use.
+ *
+ * A page table entry uses the same layout as the MIPS TLB EntryLo
+ * register, so an entry for a resident page can be written into the
+ * TLB as is. The low byte, which the TLB ignores, holds software bits.
+ *
+ * The MIPS TLB has no referenced bit, so we fake one: the pageout
+ * clock sets PTE_NOREF and drops the TLB entry, the UTLB refill
+ * handler refuses to load entries with PTE_NOREF set, and vm_fault
+ * clears it on the next access.
+ *
+ * Functions:
+ *     pt_create  - allocate an empty page table. Returns NULL on
+ *                  out-of-memory error.
+ *     pt_destroy - free the page table structure itself. The caller
+ *                  must already have released whatever the entries
+ *                  referred to.
+ *     pt_lookup  - return a pointer to the entry for VADDR, or NULL if
+ *                  there is no second-level table for it. With CREATE
+ *                  set, allocates the second-level table if needed
+ *                  (NULL then means out of memory).
+ */
+
+#include <vm.h>
+
+typedef uint32_t pte_t;
+
+/* Hardware bits (same as TLBLO_*) */
+#define PTE_FRAME	0xfffff000	/* physical page number */
+#define PTE_NOCACHE	0x00000800
+#define PTE_WRITE	0x00000400	/* TLBLO_DIRTY: writes allowed */
+#define PTE_VALID	0x00000200	/* page is resident */
+
+/* Software bits */
+#define PTE_SWAPPED	0x00000001	/* paged out; frame bits hold slot */
+#define PTE_NOREF	0x00000002	/* not used since the clock hand passed */
+#define PTE_FILE	0x00000004	/* frame belongs to the page cache */
+#define PTE_ZERO	0x00000008	/* the shared zero page (read-only) */
+#define PTE_BUSY	0x00000010	/* with PTE_SWAPPED: still being written */
+
+/* Entries for paged-out pages */
+#define PTE_MKSWAP(slot) (((pte_t)(slot) << 12) | PTE_SWAPPED)
+#define PTE_SLOT(pte)	((unsigned)((pte) >> 12))
+
+#define PT_NENTRIES	(PAGE_SIZE / sizeof(pte_t))
+#define PT_DIRINDEX(va)	((vaddr_t)(va) >> 22)
+#define PT_TABINDEX(va)	(((vaddr_t)(va) >> 12) & (PT_NENTRIES - 1))
+
+/* Rebuild a page address from directory and table indexes */
+#define PT_VADDR(di, ti) (((vaddr_t)(di) << 22) | ((vaddr_t)(ti) << 12))
+
+struct pagetable {
+	pte_t *pt_dir[PT_NENTRIES];	/* second-level tables, or NULL */
+};
+
+struct pagetable *pt_create(void);
+void pt_destroy(struct pagetable *pt);
+pte_t *pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create);
+
+/*
+ * In vm.c: wait until a PTE_BUSY entry's page has been written to
+ * swap. Call with the paging lock held.
+ */
+void vm_pagewait(pte_t *pte);
+
+/*
+ * Also in vm.c: wait until a PTE_FILE entry's page isn't being read
+ * into the page cache. Likewise.
+ */
+void vm_filewait(pte_t *pte);
+
+#endif /* _PAGETABLE_H_ */
@@ -40,6 +40,7 @@
 #define MAX_PROCESSES 32
 #define PROC_RESERVED_SPOT 0xcafebabe
 #define PROC_MAX_HEAP_PAGES 2048
+#define PROC_MAX_STACK_PAGES 4096	/* stack may grow to 16M */
 struct addrspace;
 struct thread;
 struct vnode;
@@ -0,0 +1,37 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space.
+ *
+ * Swap is a raw disk device, attached with vfs_swapon and divided
+ * into page-sized slots tracked by a bitmap. A page table entry for
+ * a page that has been paged out holds its slot number (see
+ * PTE_SWAPPED in pagetable.h).
+ *
+ * Functions:
+ *     swap_on         - start swapping to DEVNAME (e.g. "lhd1raw:").
+ *                       Only one swap device can be in use.
+ *     swap_enabled    - true once swap_on has succeeded.
+ *     swap_alloc      - reserve a slot. Returns ENOSPC if swap is
+ *                       full or not enabled.
+ *     swap_free       - release a slot.
+ *     swap_write      - write the page at physical address PADDR to
+ *                       a slot.
+ *     swap_read       - read a slot into the page at PADDR.
+ *     swap_printstats - print slot usage and paging counters.
+ *
+ * The I/O functions sleep, so must not be called with spinlocks held.
+ */
+
+#include <vm.h>
+
+int swap_on(const char *devname);
+bool swap_enabled(void);
+int swap_alloc(unsigned *slot_ret);
+void swap_free(unsigned slot);
+int swap_write(paddr_t paddr, unsigned slot);
+int swap_read(paddr_t paddr, unsigned slot);
+void swap_printstats(void);
+
+#endif /* _SWAP_H_ */
@@ -138,5 +138,10 @@ void cv_wait(struct cv *cv, struct lock *lock);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
+/*
+ * Set up the object caches the create functions allocate from. Called
+ * once during boot, before any of them.
+ */
+void synch_bootstrap(void);
 
 #endif /* _SYNCH_H_ */
@@ -59,5 +59,9 @@ __DEAD void enter_new_process(int argc, userptr_t argv, userptr_t env,
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_sbrk(intptr_t amount, vaddr_t *retval);	/* paged VM only */
+int sys_mmap(vaddr_t addr, size_t len, int prot, int flags, int fd,
+	     off_t offset, vaddr_t *retval);		/* paged VM only */
+int sys_munmap(vaddr_t addr, size_t len);		/* paged VM only */
 
 #endif /* _SYSCALL_H_ */
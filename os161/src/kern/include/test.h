@@ -93,8 +93,12 @@ int kmalloctest(int, char **);
 int kmallocstress(int, char **);
 int kmalloctest3(int, char **);
 int kmalloctest4(int, char **);
+int kmalloctest5(int, char **);
 int nettest(int, char **);
 
+/* VM tests */
+int tlbrefillbench(int, char **);
+
 /* Routine for running a user-level program. */
 int runprogram(char *progname);
 
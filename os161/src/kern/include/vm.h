@@ -59,15 +59,33 @@ void free_kpages(vaddr_t addr);
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
-struct page{
-				paddr_t frame_start_addr;
-				unsigned int allocation_length;
-				//We need flags
-				unsigned int allocated_flag; //keep track of physical memory and see if it is available or not. (0 = not alloc, 1 = alloc)
-				unsigned int user_kernel_flag; // keep track if frame is for user/kernel (0 = flag not set, 1 = user, 2 = kern)
-				unsigned int shared_counter; //keep count of if this frame is shared by multiple pages ( 0 = flag not set, 1 = one user, 2 = two users ...etc.)
-};
- paddr_t alloc_one_frame(unsigned int npages);
-	 paddr_t alloc_multiple_frames(unsigned int npages);
-		 void free_frames(vaddr_t vaddr);
+/*
+ * Paging (paged VM only). vm_getpage returns a pinned frame for a user
+ * page, paging something out if necessary, or 0; vm_pagedirty forgets
+ * the swap copy of a page that is about to be changed, shared or
+ * freed. Call both with the paging lock held.
+ */
+struct addrspace;
+void vm_pagelock_acquire(void);
+void vm_pagelock_release(void);
+paddr_t vm_getpage(struct addrspace *as, vaddr_t vaddr);
+void vm_pagedirty(paddr_t paddr);
+void vm_printstats(void);
+
+/*
+ * Bring the page cache up to date after LEN bytes at OFFSET of VN were
+ * written (paged VM only). Call without the paging lock.
+ */
+struct vnode;
+void vm_filewritten(struct vnode *vn, off_t offset, size_t len);
+
+/* Set the fault-around window for file pages (paged VM only) */
+void vm_setfaultaround(unsigned npages);
+
+/* Invalidate every entry in this CPU's TLB */
+void vm_tlbflush(void);
+
+/* Print TLB context switch counters */
+void vm_tlbprintstats(void);
+
 #endif /* _VM_H_ */
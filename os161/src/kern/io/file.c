@@ -4,9 +4,27 @@
 #include <file.h>
 #include <filedesc.h>
 #include <vfs.h>
+#include <kheap.h>
 
+static struct kmem_cache *file_cache;
 
+void
+file_bootstrap( void ) {
+	file_cache = kmem_cache_create( "file", sizeof( struct file ),
+					NULL, NULL );
+	if( file_cache == NULL )
+		panic( "file_bootstrap: Out of memory\n" );
+}
+
+struct file *
+file_alloc( void ) {
+	return kmem_cache_alloc( file_cache );
+}
 
+void
+file_free( struct file *f ) {
+	kmem_cache_free( file_cache, f );
+}
 
 void
 des_file( struct file *f ) {
@@ -20,7 +38,7 @@ des_file( struct file *f ) {
 	lock_destroy( f->f_lk );
 
 	//free the memory
-	kfree( f );
+	file_free( f );
 }
 
 /**
@@ -45,6 +45,7 @@
 #include <vm.h>
 #include <mainbus.h>
 #include <vfs.h>
+#include <file.h>
 #include <device.h>
 #include <syscall.h>
 #include <test.h>
@@ -89,8 +90,10 @@ boot(void)
 	ram_bootstrap();
 
 	thread_bootstrap();
+	synch_bootstrap();
 	hardclock_bootstrap();
 	vfs_bootstrap();
+	file_bootstrap();
 	kheap_nextgeneration();
 	/*thcv=cv_create("thcv");
 	thread_list_lock=lock_create("thread_list_lock");
@@ -109,7 +112,7 @@ if (thread_list_lock == NULL) {
 	pseudoconfig();
 	kprintf("\n");
 	kheap_nextgeneration();
-	//vm_bootstrap();
+	vm_bootstrap();
 	kprintf_bootstrap();
 	thread_start_cpus();
 	vfs_setbootfs("emu0");
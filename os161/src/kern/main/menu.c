@@ -46,8 +46,12 @@
 #include <syscall.h>
 #include <test.h>
 #include <file_syscall.h>
+#include <coremap.h>
+#include <swap.h>
+#include <pagecache.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-dumbvm.h"
 #include <current.h>
 /*
  * In-kernel menu and command dispatcher.
@@ -560,6 +564,55 @@ cmd_bootfs(int nargs, char **args)
 	return vfs_setbootfs(device);
 }
 
+#if !OPT_DUMBVM
+/*
+ * Command for enabling swap. Takes the device as either the mount
+ * name (lhd1:) or the raw device (lhd1raw:), which is what actually
+ * gets used; vfs_swapon wants the former. Defaults to lhd1.
+ */
+static
+int
+cmd_swapon(int nargs, char **args)
+{
+	char defdevice[] = "lhd1";
+	char *device;
+	size_t len;
+
+	if (nargs > 2) {
+		kprintf("Usage: swapon [device]\n");
+		return EINVAL;
+	}
+
+	device = nargs == 2 ? args[1] : defdevice;
+
+	len = strlen(device);
+	if (len > 0 && device[len-1] == ':') {
+		device[--len] = 0;
+	}
+	if (len > 3 && !strcmp(device + len - 3, "raw")) {
+		device[len - 3] = 0;
+	}
+
+	return swap_on(device);
+}
+
+/*
+ * Command for setting the fault-around window.
+ */
+static
+int
+cmd_faultaround(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: fa npages\n");
+		return EINVAL;
+	}
+
+	vm_setfaultaround(atoi(args[1]));
+	return 0;
+}
+#endif
+
 static
 int
 cmd_kheapstats(int nargs, char **args)
@@ -572,6 +625,54 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_kheapprofile(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kheap_profile();
+	}
+	else if (nargs == 2) {
+		kheap_setprofrate(atoi(args[1]));
+	}
+	else {
+		kprintf("Usage: khprof [rate]\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_coremapstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	coremap_printstats();
+#if !OPT_DUMBVM
+	vm_printstats();
+	swap_printstats();
+	vm_pagelock_acquire();
+	pagecache_printstats();
+	vm_pagelock_release();
+#endif
+
+	return 0;
+}
+
+static
+int
+cmd_tlbstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_tlbprintstats();
+
+	return 0;
+}
+
 static
 int
 cmd_kheapgeneration(int nargs, char **args)
@@ -643,6 +744,10 @@ static const char *opsmenu[] = {
 	"[debug]   Drop to debugger          ",
 	"[panic]   Intentional panic         ",
 	"[deadlock] Intentional deadlock     ",
+#if !OPT_DUMBVM
+	"[swapon]  Enable swap (lhd1raw:)    ",
+	"[fa]      Set fault-around window   ",
+#endif
 	"[q]       Quit and shut down        ",
 	NULL
 };
@@ -667,6 +772,10 @@ static const char *testmenu[] = {
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+	"[km5] Object cache test             ",
+#if !OPT_DUMBVM
+	"[tlbb] TLB refill benchmark         ",
+#endif
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -708,6 +817,9 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[khprof] Kernel heap profile        ",
+	"[cm] Physical memory stats          ",
+	"[tlb] TLB switch stats              ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -751,6 +863,10 @@ static struct {
 	{ "debug",	cmd_debug },
 	{ "panic",	cmd_panic },
 	{ "deadlock",	cmd_deadlock },
+#if !OPT_DUMBVM
+	{ "swapon",	cmd_swapon },
+	{ "fa",		cmd_faultaround },
+#endif
 	{ "q",		cmd_quit },
 	{ "exit",	cmd_quit },
 	{ "halt",	cmd_quit },
@@ -759,6 +875,9 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "khprof",     cmd_kheapprofile },
+	{ "cm",         cmd_coremapstats },
+	{ "tlb",        cmd_tlbstats },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -769,6 +888,10 @@ static struct {
 	{ "km2",	kmallocstress },
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
+	{ "km5",	kmalloctest5 },
+#if !OPT_DUMBVM
+	{ "tlbb",	tlbrefillbench },
+#endif
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -10,6 +10,7 @@
 #include <thread.h>
 #include <synch.h>
 #include <filedesc.h>
+#include <kheap.h>
 /*
  * The process for the kernel; this holds all the kernel-only threads.
  */
@@ -18,6 +19,7 @@ struct proc *kproc;
  * Create a proc structure.
  */
 struct lock 		*lk_allproc;
+static struct kmem_cache	*proc_cache;
 
 int			next_pid;
 static
@@ -84,7 +86,7 @@ proc_create( struct proc **res )  {
 	err = proc_alloc_pid( &pid );
 	if( err )
 		return err;
-	p = kmalloc( sizeof( struct proc ) );
+	p = kmem_cache_alloc( proc_cache );
 	if( p == NULL ) {
 		proc_dealloc_pid( pid );
 		return ENOMEM;
@@ -92,14 +94,14 @@ proc_create( struct proc **res )  {
 	p->p_pid = pid;
 	err = fd_create(& p->p_fd );
 	if( err ) {
-		kfree( p );
+		kmem_cache_free( proc_cache, p );
 		proc_dealloc_pid( pid );
 		return err;
 	}
 	p->lock = lock_create( "lock" );
 	if( p->lock == NULL ) {
 		fd_destroy( p->p_fd );
-		kfree( p );
+		kmem_cache_free( proc_cache, p );
 		proc_dealloc_pid( pid );
 		return ENOMEM;
 	}
@@ -107,7 +109,7 @@ proc_create( struct proc **res )  {
 	if( p->p_sem == NULL ) {
 		lock_destroy( p->lock );
 		fd_destroy( p->p_fd  );
-		kfree( p );
+		kmem_cache_free( proc_cache, p );
 		proc_dealloc_pid( pid );
 		return ENOMEM;
 	}
@@ -151,7 +153,7 @@ void proc_destroy(struct proc *proc)
 	fd_destroy( proc->p_fd );
 
 	//free the memory.
-	kfree( proc );
+	kmem_cache_free( proc_cache, proc );
 
 	//deallocate the pid.
 	proc_dealloc_pid( pid );
@@ -162,6 +164,10 @@ proc_system_init( void ) {
 	for( i = 0; i < MAX_PROCESSES; ++i ) {
 		p_table[i] = NULL;
 	}
+	proc_cache = kmem_cache_create( "proc", sizeof( struct proc ),
+					NULL, NULL );
+	if( proc_cache == NULL )
+		panic( "could not create proc cache." );
 	lk_allproc = lock_create( "lk_allproc" );
 	if( lk_allproc == NULL ) 
 		panic( "could not initialize proc system." );
@@ -19,6 +19,8 @@
 #include <kern/wait.h>
 #include <kern/fork.h> 
 #include <cpu.h> 
+#include <vm.h>
+#include "opt-dumbvm.h"
 #define SEEK_SET	0	/* Seek from beginning of file.  */
 #define SEEK_CUR	1	/* Seek from current position.  */
 #define SEEK_END	2	/* Seek from end of file.  */
@@ -70,7 +72,7 @@ k_open( struct proc *p, char *path, int flags, int *retval ) {
 
 		//create file
 	struct file *res;
-	res = kmalloc( sizeof( struct file ) );
+	res = file_alloc();
 	if( res == NULL )
 		return ENOMEM;
 	res->f_oflags = flags;
@@ -79,7 +81,7 @@ k_open( struct proc *p, char *path, int flags, int *retval ) {
 	res->f_offset = 0;
 	res->f_lk = lock_create( "f_lk" );
 	if( res->f_lk == NULL ) {
-		kfree( res );
+		file_free( res );
 		err= ENOMEM;
 	}
 	f = res;
@@ -186,7 +188,13 @@ int sys_write(int fd, void *buffer, size_t nBytes)
     struct iovec iov;
     uio_uinit(&iov, &u, buffer, nBytes, curproc->p_fd -> fd_ofiles[fd] -> f_offset, UIO_WRITE);
     size_t remaining = u.uio_resid;
-    result = VOP_WRITE(curproc ->p_fd-> fd_ofiles[fd] -> f_vnode, &u);
+    struct vnode *vn = curproc ->p_fd-> fd_ofiles[fd] -> f_vnode;
+    result = VOP_WRITE(vn, &u);
+#if !OPT_DUMBVM
+    /* Mapped pages of the file must see whatever got written. */
+    vm_filewritten(vn, u.uio_offset - (nBytes - u.uio_resid),
+                   nBytes - u.uio_resid);
+#endif
     if (result) {
 		lock_release(curproc  ->p_fd -> fd_lk);
 		return result;
@@ -208,7 +216,7 @@ int sys_close(int fd)
         vfs_close(curproc ->p_fd-> fd_ofiles[fd] -> f_vnode);
         lock_release(curproc ->p_fd->  fd_lk);
         lock_destroy(curproc ->p_fd-> fd_lk);
-        kfree(curproc ->p_fd-> fd_ofiles[fd]);
+        file_free(curproc ->p_fd-> fd_ofiles[fd]);
         curproc ->p_fd-> fd_ofiles[fd] = NULL;	
         return 0;
     }
@@ -374,14 +382,14 @@ if (curproc->p_fd == NULL) {
 
 // Ensure fd_ofiles is properly initialized (usually part of the structure)
 if (curproc->p_fd->fd_ofiles[0] == NULL) {
-    curproc->p_fd->fd_ofiles[0] = kmalloc(sizeof(struct file));
+    curproc->p_fd->fd_ofiles[0] = file_alloc();
     if (curproc->p_fd->fd_ofiles[0] == NULL) {
         panic("kmalloc for fd_ofiles[0] failed");
     }
 }
 ///////////////////////////////////////////////
     char c0[] = "con:";
-    curproc -> p_fd -> fd_ofiles[0] = kmalloc(sizeof(struct file));
+    curproc -> p_fd -> fd_ofiles[0] = file_alloc();
     /*
 	 * fails to malloc
 	 */
@@ -399,12 +407,12 @@ if (curproc->p_fd->fd_ofiles[0] == NULL) {
 	 * fails to create lock
 	 */
     if (curproc -> p_fd -> fd_ofiles[0] -> f_lk == NULL) {
-        kfree(curproc -> p_fd -> fd_ofiles[0]);
+        file_free(curproc -> p_fd -> fd_ofiles[0]);
         return ENOMEM;
     }
     sys_close(0); // file descriptor 0 at the start of the program can start closed
     char c1[] = "con:";
-    curproc -> p_fd -> fd_ofiles[1] = kmalloc(sizeof(struct file_handle));
+    curproc -> p_fd -> fd_ofiles[1] = file_alloc();
     /*
 	 * fails to malloc
 	 */
@@ -422,11 +430,11 @@ if (curproc->p_fd->fd_ofiles[0] == NULL) {
 	 * fails to create lock
 	 */
     if (curproc -> p_fd -> fd_ofiles[1] -> f_lk == NULL) {
-        kfree(curproc -> p_fd -> fd_ofiles[1]);
+        file_free(curproc -> p_fd -> fd_ofiles[1]);
         return ENOMEM;      // no enough memory
     }
     char c2[] = "con:";
-    curproc -> p_fd -> fd_ofiles[2] = kmalloc(sizeof(struct file_handle));
+    curproc -> p_fd -> fd_ofiles[2] = file_alloc();
     /*
 	 * fails to malloc
 	 */
@@ -444,7 +452,7 @@ if (curproc->p_fd->fd_ofiles[0] == NULL) {
 	 * fails to create lock
 	 */
     if (curproc -> p_fd -> fd_ofiles[2] -> f_lk == NULL) {
-        kfree(curproc -> p_fd -> fd_ofiles[2]);
+        file_free(curproc -> p_fd -> fd_ofiles[2]);
         return ENOMEM;      // no enough memory
     }
     return 0;
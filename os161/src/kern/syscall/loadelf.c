@@ -32,9 +32,11 @@
  * Code to load an ELF-format executable into the current address space.
  *
  * It makes the following address space calls:
- *    - first, as_define_region once for each segment of the program;
+ *    - first, as_define_region once for each segment of the program,
+ *      or as_define_file for segments that can be paged straight
+ *      from the file (see segment_is_mapped);
  *    - then, as_prepare_load;
- *    - then it loads each chunk of the program;
+ *    - then it loads each chunk of the program that isn't mapped;
  *    - finally, as_complete_load.
  *
  * This gives the VM code enough flexibility to deal with even grossly
@@ -59,6 +61,7 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
+#include "opt-dumbvm.h"
 
 /*
  * Load a segment at virtual address VADDR. The segment in memory
@@ -144,6 +147,56 @@ load_segment(struct vnode *v, off_t offset, vaddr_t vaddr,
 	return result;
 }
 
+/*
+ * Can segment PH be paged in straight from the file instead of being
+ * loaded? Any segment with file contents that line up with its
+ * address within a page is given to the VM system as a file region:
+ * nothing is read until the program touches it, and whole pages of
+ * file data are shared, through the page cache, with every other
+ * process running the same program (copied on write if the segment
+ * is writable). (dumbvm can't.)
+ */
+static
+bool
+segment_is_mapped(const Elf_Phdr *ph)
+{
+#if OPT_DUMBVM
+	(void)ph;
+	return false;
+#else
+	return ph->p_filesz > 0 &&
+		ph->p_vaddr % PAGE_SIZE == ph->p_offset % PAGE_SIZE;
+#endif
+}
+
+/*
+ * Set up the region for segment PH of the program in file V.
+ */
+static
+int
+define_segment(struct vnode *v, const Elf_Phdr *ph)
+{
+	struct addrspace *as = curthread->t_addrspace;
+
+#if !OPT_DUMBVM
+	if (segment_is_mapped(ph)) {
+		return as_define_file(as, ph->p_vaddr, ph->p_memsz,
+				      ph->p_filesz < ph->p_memsz ?
+				      ph->p_filesz : ph->p_memsz,
+				      ph->p_flags & PF_R,
+				      ph->p_flags & PF_W,
+				      ph->p_flags & PF_X,
+				      v, ph->p_offset);
+	}
+#else
+	(void)v;
+#endif
+	return as_define_region(as, ph->p_vaddr, ph->p_memsz,
+				ph->p_flags & PF_R,
+				ph->p_flags & PF_W,
+				ph->p_flags & PF_X);
+}
+
 /*
  * Load an ELF executable user program into the current address space.
  *
@@ -239,11 +292,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
-		result = as_define_region(curthread->t_addrspace,
-					  ph.p_vaddr, ph.p_memsz,
-					  ph.p_flags & PF_R,
-					  ph.p_flags & PF_W,
-					  ph.p_flags & PF_X);
+		result = define_segment(v, &ph);
 		if (result) {
 			return result;
 		}
@@ -284,6 +333,11 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+		if (segment_is_mapped(&ph)) {
+			/* Paged in from the file as it is used. */
+			continue;
+		}
+
 		result = load_segment(v, ph.p_offset, ph.p_vaddr, 
 				      ph.p_memsz, ph.p_filesz,
 				      ph.p_flags & PF_X);
@@ -0,0 +1,114 @@
+/*
+ * Memory management system calls for the paged VM system.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <thread.h>
+#include <current.h>
+#include <synch.h>
+#include <vnode.h>
+#include <file.h>
+#include <addrspace.h>
+#include <syscall.h>
+
+/*
+ * sbrk: move the heap break by AMOUNT bytes and return the old break.
+ */
+int
+sys_sbrk(intptr_t amount, vaddr_t *retval)
+{
+	struct addrspace *as;
+
+	as = curthread->t_addrspace;
+	if (as == NULL) {
+		return EINVAL;
+	}
+	return as_sbrk(as, amount, retval);
+}
+
+/*
+ * mmap: map LEN bytes of open file FD, from OFFSET, anywhere in the
+ * address space (ADDR is only a hint, and we ignore it), and return
+ * where.
+ *
+ * Pages are shared through the page cache with other mappings of the
+ * same file. Since nothing is ever written back to the file, shared
+ * writable mappings are refused; private ones get their own copy of
+ * each page when it is first written.
+ */
+int
+sys_mmap(vaddr_t addr, size_t len, int prot, int flags, int fd,
+	 off_t offset, vaddr_t *retval)
+{
+	struct addrspace *as;
+	struct file *f;
+	struct vnode *vn;
+	unsigned rgflags;
+	int result;
+
+	(void)addr;
+
+	as = curthread->t_addrspace;
+	if (as == NULL) {
+		return EINVAL;
+	}
+	if (len == 0 || offset < 0 || offset % PAGE_SIZE != 0 ||
+	    (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0) {
+		return EINVAL;
+	}
+	if (flags == MAP_SHARED && (prot & PROT_WRITE)) {
+		return ENOTSUP;
+	}
+	if (flags != MAP_SHARED && flags != MAP_PRIVATE) {
+		return EINVAL;
+	}
+
+	result = get_file(curthread->td_proc, fd, &f);
+	if (result) {
+		return result;
+	}
+	if ((f->f_oflags & O_ACCMODE) == O_WRONLY) {
+		lock_release(f->f_lk);
+		return EACCES;
+	}
+	vn = f->f_vnode;
+	VOP_INCREF(vn);
+	lock_release(f->f_lk);
+
+	result = VOP_MMAP(vn);
+	if (result == 0) {
+		rgflags = 0;
+		if (prot & PROT_READ) {
+			rgflags |= RG_READ;
+		}
+		if (prot & PROT_WRITE) {
+			rgflags |= RG_WRITE;
+		}
+		if (prot & PROT_EXEC) {
+			rgflags |= RG_EXEC;
+		}
+		result = as_mmap(as, len, rgflags, vn, offset, retval);
+	}
+	VOP_DECREF(vn);
+	return result;
+}
+
+/*
+ * munmap: remove a mapping made by mmap. Only whole mappings can be
+ * removed.
+ */
+int
+sys_munmap(vaddr_t addr, size_t len)
+{
+	struct addrspace *as;
+
+	as = curthread->t_addrspace;
+	if (as == NULL) {
+		return EINVAL;
+	}
+	return as_munmap(as, addr, len);
+}
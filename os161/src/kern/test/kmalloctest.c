@@ -35,11 +35,10 @@
 #include <lib.h>
 #include <thread.h>
 #include <synch.h>
+#include <kheap.h>
 #include <vm.h> /* for PAGE_SIZE */
 #include <test.h>
 
-#include "opt-dumbvm.h"
-
 ////////////////////////////////////////////////////////////
 // km1/km2
 
@@ -349,9 +348,6 @@ kmalloctest4(int nargs, char **args)
 	(void)args;
 
 	kprintf("Starting multipage kmalloc test...\n");
-#if OPT_DUMBVM
-	kprintf("(This test will not work with dumbvm)\n");
-#endif
 
 	sem = sem_create("kmalloctest4", 0);
 	if (sem == NULL) {
@@ -378,3 +374,111 @@ kmalloctest4(int nargs, char **args)
 	kprintf("Multipage kmalloc test done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+// km5
+
+/*
+ * Object cache test. Allocate KMEMTEST_NOBJS objects of an odd size,
+ * enough for several slabs, check that each comes back constructed
+ * and that none overlap, and free them in a scrambled order. Do it
+ * twice, so the second round reuses freed objects. Destroying the
+ * cache at the end must destroy exactly what was constructed.
+ */
+
+#define KMEMTEST_NOBJS	200	/* must be coprime to 7 */
+#define KMEMTEST_FILL	44
+#define KMEMTEST_MAGIC	0xc0ffee11
+
+struct kmemtest_obj {
+	uint32_t ko_magic;		/* set by the constructor */
+	uint32_t ko_id;
+	unsigned char ko_fill[KMEMTEST_FILL];
+};
+
+static unsigned kmemtest_nctor, kmemtest_ndtor;
+
+static
+int
+kmemtest_ctor(void *obj)
+{
+	struct kmemtest_obj *ko = obj;
+
+	ko->ko_magic = KMEMTEST_MAGIC;
+	kmemtest_nctor++;
+	return 0;
+}
+
+static
+void
+kmemtest_dtor(void *obj)
+{
+	struct kmemtest_obj *ko = obj;
+
+	KASSERT(ko->ko_magic == KMEMTEST_MAGIC);
+	ko->ko_magic = 0;
+	kmemtest_ndtor++;
+}
+
+int
+kmalloctest5(int nargs, char **args)
+{
+	struct kmem_cache *kc;
+	struct kmemtest_obj **objs;
+	unsigned i, j, pass;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting kmem cache test...\n");
+
+	kmemtest_nctor = kmemtest_ndtor = 0;
+	kc = kmem_cache_create("kmemtest", sizeof(struct kmemtest_obj),
+			       kmemtest_ctor, kmemtest_dtor);
+	if (kc == NULL) {
+		panic("kmalloctest5: kmem_cache_create failed\n");
+	}
+	objs = kmalloc(KMEMTEST_NOBJS * sizeof(*objs));
+	if (objs == NULL) {
+		panic("kmalloctest5: failed on pointer array\n");
+	}
+
+	for (pass=0; pass<2; pass++) {
+		for (i=0; i<KMEMTEST_NOBJS; i++) {
+			objs[i] = kmem_cache_alloc(kc);
+			if (objs[i] == NULL) {
+				panic("kmalloctest5: failed on object %u\n",
+				      i);
+			}
+			if (objs[i]->ko_magic != KMEMTEST_MAGIC) {
+				panic("kmalloctest5: object %u at %p not "
+				      "constructed\n", i, objs[i]);
+			}
+			objs[i]->ko_id = i;
+			memset(objs[i]->ko_fill, i, KMEMTEST_FILL);
+		}
+		for (i=0; i<KMEMTEST_NOBJS; i++) {
+			for (j=0; j<KMEMTEST_FILL; j++) {
+				if (objs[i]->ko_id != i ||
+				    objs[i]->ko_fill[j] != (unsigned char)i) {
+					panic("kmalloctest5: object %u at %p "
+					      "overwritten\n", i, objs[i]);
+				}
+			}
+		}
+		for (i=0; i<KMEMTEST_NOBJS; i++) {
+			kmem_cache_free(kc, objs[(i * 7) % KMEMTEST_NOBJS]);
+		}
+	}
+
+	kfree(objs);
+	kmem_cache_destroy(kc);
+
+	kprintf("kmalloctest5: %u constructed, %u destroyed\n",
+		kmemtest_nctor, kmemtest_ndtor);
+	if (kmemtest_nctor != kmemtest_ndtor) {
+		panic("kmalloctest5: failed.\n");
+	}
+	kprintf("kmem cache test done\n");
+	return 0;
+}
@@ -0,0 +1,138 @@
+/*
+ * Tests and benchmarks for the paged VM system.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <test.h>
+
+////////////////////////////////////////////////////////////
+// tlbb
+
+/*
+ * TLB refill benchmark.
+ *
+ * Build a scratch address space with BENCH_NPAGES resident pages,
+ * more than the TLB can hold, and read one word from each page in
+ * turn, so that nearly every access is a TLB miss. Do it once with
+ * the UTLB refill handler walking the page table, and once with the
+ * page table hidden from it so every miss goes through the general
+ * exception path and vm_fault, and compare.
+ *
+ * The loops run with interrupts on, since vm_fault may sleep on the
+ * paging lock, so the times include interrupts and anything else
+ * that gets to run meanwhile; use an otherwise idle system. A context
+ * switch gives the refill handler the address space's page table
+ * back, so both loops set cpupagetables[] again before every access,
+ * one to the page table and the other to nothing; that way the cost
+ * of doing so is the same on both sides.
+ */
+
+#define BENCH_BASE	0x10000000
+#define BENCH_NPAGES	256
+#define BENCH_PASSES	64
+
+/*
+ * Point this cpu's refill handler at page table PT, or at nothing if
+ * PT is 0.
+ */
+static
+void
+tlbbench_setpt(vaddr_t pt)
+{
+	int spl;
+
+	spl = splhigh();
+	cpupagetables[curcpu->c_number] = pt;
+	splx(spl);
+}
+
+static
+uint64_t
+tlbbench_run(vaddr_t pt)
+{
+	struct timespec before, after;
+	volatile int *p;
+	unsigned i, j;
+
+	gettime(&before);
+	for (j=0; j<BENCH_PASSES; j++) {
+		for (i=0; i<BENCH_NPAGES; i++) {
+			tlbbench_setpt(pt);
+			p = (volatile int *)(BENCH_BASE + i * PAGE_SIZE);
+			(void)*p;
+		}
+	}
+	gettime(&after);
+
+	timespec_sub(&after, &before, &after);
+	return (uint64_t)after.tv_sec * 1000000000 + after.tv_nsec;
+}
+
+int
+tlbrefillbench(int nargs, char **args)
+{
+	struct addrspace *as, *oldas;
+	uint64_t fast, slow, n;
+	vaddr_t pt;
+	unsigned i;
+	int result, spl;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting TLB refill benchmark...\n");
+
+	as = as_create();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+	result = as_define_region(as, BENCH_BASE, BENCH_NPAGES * PAGE_SIZE,
+				  1, 1, 0);
+	if (result) {
+		as_destroy(as);
+		return result;
+	}
+
+	oldas = curthread->t_addrspace;
+	curthread->t_addrspace = as;
+	as_activate(as);
+
+	/* Fault everything in. */
+	for (i=0; i<BENCH_NPAGES; i++) {
+		*(volatile int *)(BENCH_BASE + i * PAGE_SIZE) = i;
+	}
+
+	/* The page table as_activate gave the refill handler. */
+	spl = splhigh();
+	pt = cpupagetables[curcpu->c_number];
+	splx(spl);
+	KASSERT(pt != 0);
+
+	fast = tlbbench_run(pt);
+
+	/* Now with the page table hidden from the refill handler. */
+	vm_tlbflush();
+	slow = tlbbench_run(0);
+
+	curthread->t_addrspace = oldas;
+	as_activate(oldas);
+	as_destroy(as);
+
+	n = (uint64_t)BENCH_PASSES * BENCH_NPAGES;
+	kprintf("%u pages, %u passes\n", BENCH_NPAGES, BENCH_PASSES);
+	kprintf("UTLB refill handler: %llu ns per access\n",
+		(unsigned long long)(fast / n));
+	kprintf("vm_fault path:       %llu ns per access\n",
+		(unsigned long long)(slow / n));
+	kprintf("TLB refill benchmark done.\n");
+
+	return 0;
+}
@@ -52,12 +52,17 @@
 #include <vnode.h>
 #include <file_syscall.h>
 #include <vfs.h>
+#include <kheap.h>
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 /* Master array of CPUs. */
 DECLARRAY(cpu, static __UNUSED inline);
 DEFARRAY(cpu, static __UNUSED inline);
 static struct cpuarray allcpus;
+
+/* Object caches for threads and wait channels. */
+static struct kmem_cache *thread_cache;
+static struct kmem_cache *wchan_cache;
 static struct semaphore *cpu_startup_sem;
 ////////////////////////////////////////////////////////////
 static
@@ -85,13 +90,13 @@ struct thread *thread_create(const char *name)
 {
 	struct thread *thread;
 	DEBUGASSERT(name != NULL);
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		kmem_cache_free(thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -133,6 +138,11 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	coremap_pcpu_init(&c->c_pagecache);
+	kheap_pcpu_init(&c->c_heapcache);
+	c->c_tlbnext = 0;
+	c->c_tlbgen = 0;
+	c->c_tlbasid = 0;
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
@@ -140,6 +150,8 @@ cpu_create(unsigned hardware_number)
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_seq = 0;
+	c->c_shootdown_done = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -192,7 +204,7 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(thread_cache, thread);
 }
 static void exorcise(void)
 {
@@ -222,6 +234,14 @@ thread_bootstrap(void)
 	struct cpu *bootcpu;
 	struct thread *bootthread;
 
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread),
+					 NULL, NULL);
+	wchan_cache = kmem_cache_create("wchan", sizeof(struct wchan),
+					NULL, NULL);
+	if (thread_cache == NULL || wchan_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+
 	cpuarray_init(&allcpus);
 	bootcpu = cpu_create(0);
 	bootthread = bootcpu->c_curthread;
@@ -611,7 +631,7 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = kmem_cache_alloc(wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
@@ -631,7 +651,13 @@ wchan_destroy(struct wchan *wc)
 {
 	spinlock_cleanup(&wc->wc_lock);
 	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	kmem_cache_free(wchan_cache, wc);
+}
+
+void
+wchan_setname(struct wchan *wc, const char *name)
+{
+	wc->wc_name = name;
 }
 /*
  * Yield the cpu to another process, and go to sleep, on the specified
@@ -773,28 +799,57 @@ ipi_broadcast(int code)
 }
 
 /*
- * Send a TLB shootdown IPI to the specified CPU.
+ * Send a TLB shootdown IPI carrying N mappings to the specified CPU,
+ * or asking it to flush its whole TLB if MAPPINGS is NULL. Requests
+ * that don't fit in the target's queue turn into a full flush too.
+ * Returns a ticket for ipi_tlbshootdown_wait.
  */
-void
-ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+unsigned
+ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mappings,
+		 unsigned n)
 {
-	unsigned n;
+	unsigned i, num, ticket;
 
 	spinlock_acquire(&target->c_ipi_lock);
 
-	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
-		target->c_numshootdown = TLBSHOOTDOWN_ALL;
-	}
-	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+	if (target->c_numshootdown != TLBSHOOTDOWN_ALL) {
+		num = target->c_numshootdown;
+		if (mappings == NULL || num + n > TLBSHOOTDOWN_MAX) {
+			target->c_numshootdown = TLBSHOOTDOWN_ALL;
+		}
+		else {
+			for (i=0; i<n; i++) {
+				target->c_shootdown[num + i] = mappings[i];
+			}
+			target->c_numshootdown = num + n;
+		}
 	}
+	ticket = ++target->c_shootdown_seq;
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
 
 	spinlock_release(&target->c_ipi_lock);
+	return ticket;
+}
+
+/*
+ * Wait until TARGET has handled the shootdown that got TICKET. Must
+ * be called with interrupts on, since TARGET may be waiting for us
+ * in turn.
+ */
+void
+ipi_tlbshootdown_wait(struct cpu *target, unsigned ticket)
+{
+	bool done;
+
+	KASSERT(curthread->t_curspl == 0);
+
+	do {
+		spinlock_acquire(&target->c_ipi_lock);
+		done = (int)(target->c_shootdown_done - ticket) >= 0;
+		spinlock_release(&target->c_ipi_lock);
+	} while (!done);
 }
 
 /*
@@ -840,6 +895,7 @@ interprocessor_interrupt(void)
 		}
 
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdown_done = curcpu->c_shootdown_seq;
 	}
 
 	curcpu->c_ipi_pending = 0;
@@ -0,0 +1,713 @@
+#define ASINLINE
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <proc.h>
+#include <vnode.h>
+#include <addrspace.h>
+#include <pagetable.h>
+#include <pagecache.h>
+#include <coremap.h>
+#include <swap.h>
+#include <vm.h>
+
+/*
+ * Address spaces for the paged VM system.
+ *
+ * An address space is a list of regions, which record what the
+ * executable asked for, and a two-level page table, which records
+ * which physical frame backs each page. Pages are allocated one at a
+ * time, on first touch, by vm_fault; a page with no valid entry in
+ * the page table simply has not been touched yet, unless it is marked
+ * PTE_SWAPPED, in which case it has been paged out (see vm.c).
+ *
+ * The heap is one more region, kept in as_heap rather than in the
+ * region array since sbrk changes its size. It starts out empty just
+ * above the highest region of the executable.
+ *
+ * Regions made by mmap, and the segments of executables, refer to a
+ * file. Their pages are faulted in through the page cache (see
+ * vm_fault and pagecache.c) and shared with every other mapping of
+ * the same file pages; private writable mappings get copies on write,
+ * like fork. Past rg_filesz a file region is zero-filled like an
+ * anonymous one (an executable's bss). mmap places them top-down
+ * below VM_MMAPTOP, clear of the largest heap sbrk allows.
+ *
+ * The stack starts out as a single page just below USERSTACK and is
+ * extended downward by as_growstack when the process faults below it,
+ * up to PROC_MAX_STACK_PAGES; that much address space is kept clear of
+ * mappings for it. Like everything else its pages are only allocated
+ * when touched.
+ *
+ * All address spaces are kept on a list, under the paging lock, so
+ * that pageout can find which one still maps a frame that used to be
+ * shared (as_findowner).
+ */
+
+/* Initial user stack size, in pages */
+#define VM_STACKPAGES	1
+
+/* Mappings go below this, leaving room for the stack to grow */
+#define VM_MMAPTOP	(USERSTACK - PROC_MAX_STACK_PAGES * PAGE_SIZE)
+
+static struct addrspace *as_all;	/* all address spaces */
+
+struct addrspace *
+as_create(void)
+{
+	struct addrspace *as;
+
+	as = kmalloc(sizeof(struct addrspace));
+	if (as == NULL) {
+		return NULL;
+	}
+
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	regionarray_init(&as->as_regions);
+	as->as_heap.rg_vbase = 0;
+	as->as_heap.rg_npages = 0;
+	as->as_heap.rg_flags = RG_READ | RG_WRITE;
+	as->as_heap.rg_vnode = NULL;
+	as->as_heap.rg_offset = 0;
+	as->as_heap.rg_filesz = 0;
+	as->as_break = 0;
+	as->as_load_complete = true;
+	vm_tlbasid_init(&as->as_tlb);
+
+	vm_pagelock_acquire();
+	as->as_next = as_all;
+	as_all = as;
+	vm_pagelock_release();
+
+	return as;
+}
+
+/*
+ * Find the region containing VADDR, or NULL.
+ */
+struct region *
+as_find_region(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *rg;
+	unsigned i, num;
+
+	num = regionarray_num(&as->as_regions);
+	for (i=0; i<num; i++) {
+		rg = regionarray_get(&as->as_regions, i);
+		if (vaddr >= rg->rg_vbase &&
+		    vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE) {
+			return rg;
+		}
+	}
+	rg = &as->as_heap;
+	if (vaddr >= rg->rg_vbase &&
+	    vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE) {
+		return rg;
+	}
+	return NULL;
+}
+
+/*
+ * Return a region, including the heap, that overlaps [VADDR, TOP), or
+ * NULL if there is none.
+ */
+static
+struct region *
+as_find_overlap(struct addrspace *as, vaddr_t vaddr, vaddr_t top)
+{
+	struct region *rg;
+	unsigned i, num;
+
+	num = regionarray_num(&as->as_regions);
+	for (i=0; i<num; i++) {
+		rg = regionarray_get(&as->as_regions, i);
+		if (vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE &&
+		    rg->rg_vbase < top) {
+			return rg;
+		}
+	}
+	rg = &as->as_heap;
+	if (vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE &&
+	    rg->rg_vbase < top) {
+		return rg;
+	}
+	return NULL;
+}
+
+struct region *
+as_growstack(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *rg, *stack;
+	unsigned i, num;
+	vaddr_t base;
+
+	if (vaddr >= USERSTACK ||
+	    vaddr < USERSTACK - PROC_MAX_STACK_PAGES * PAGE_SIZE) {
+		return NULL;
+	}
+
+	stack = NULL;
+	num = regionarray_num(&as->as_regions);
+	for (i=0; i<num; i++) {
+		rg = regionarray_get(&as->as_regions, i);
+		if (rg->rg_flags & RG_STACK) {
+			stack = rg;
+			break;
+		}
+	}
+	if (stack == NULL || vaddr >= stack->rg_vbase) {
+		return NULL;
+	}
+
+	base = vaddr & PAGE_FRAME;
+	if (as_find_overlap(as, base, stack->rg_vbase) != NULL) {
+		return NULL;
+	}
+
+	stack->rg_npages += (stack->rg_vbase - base) / PAGE_SIZE;
+	stack->rg_vbase = base;
+	return stack;
+}
+
+/*
+ * Add an anonymous region, handing it back in RET if not NULL; fails
+ * with EINVAL if it overlaps an existing one.
+ */
+static
+int
+as_add_region(struct addrspace *as, vaddr_t vaddr, size_t npages,
+	      unsigned flags, struct region **ret)
+{
+	struct region *rg;
+	vaddr_t top;
+	int result;
+
+	top = vaddr + npages * PAGE_SIZE;
+	if (top < vaddr || top > USERSPACETOP) {
+		return EFAULT;
+	}
+
+	if (as_find_overlap(as, vaddr, top) != NULL) {
+		return EINVAL;
+	}
+
+	rg = kmalloc(sizeof(struct region));
+	if (rg == NULL) {
+		return ENOMEM;
+	}
+	rg->rg_vbase = vaddr;
+	rg->rg_npages = npages;
+	rg->rg_flags = flags;
+	rg->rg_vnode = NULL;
+	rg->rg_offset = 0;
+	rg->rg_filesz = 0;
+
+	result = regionarray_add(&as->as_regions, rg, NULL);
+	if (result) {
+		kfree(rg);
+		return result;
+	}
+	if (ret != NULL) {
+		*ret = rg;
+	}
+	return 0;
+}
+
+/*
+ * Set up the pages of region RG of OLD in NEW, for as_copy. Call with
+ * the paging lock held.
+ */
+static
+int
+as_copy_pages(struct addrspace *old, struct addrspace *new,
+	      struct region *rg)
+{
+	pte_t *oldpte, *newpte;
+	paddr_t pa;
+	vaddr_t va;
+	size_t j;
+	int result;
+
+	for (j=0; j<rg->rg_npages; j++) {
+		va = rg->rg_vbase + j * PAGE_SIZE;
+		oldpte = pt_lookup(old->as_pt, va, false);
+		if (oldpte == NULL) {
+			continue;
+		}
+		vm_pagewait(oldpte);
+		if (!(*oldpte & (PTE_VALID | PTE_SWAPPED))) {
+			continue;
+		}
+		newpte = pt_lookup(new->as_pt, va, true);
+		if (newpte == NULL) {
+			return ENOMEM;
+		}
+
+		if (*oldpte & PTE_SWAPPED) {
+			pa = vm_getpage(new, va);
+			if (pa == 0) {
+				return ENOMEM;
+			}
+			result = swap_read(pa, PTE_SLOT(*oldpte));
+			if (result) {
+				coremap_free(pa);
+				return result;
+			}
+			*newpte = pa | PTE_VALID;
+			if (rg->rg_flags & RG_WRITE) {
+				*newpte |= PTE_WRITE;
+			}
+			coremap_unpin(pa);
+			continue;
+		}
+
+		if (*oldpte & PTE_ZERO) {
+			/* The zero page is never freed; just share it. */
+			*newpte = *oldpte;
+			continue;
+		}
+
+		/* Only unshared pages keep a copy in swap. */
+		vm_pagedirty(*oldpte & PTE_FRAME);
+		coremap_incref(*oldpte & PTE_FRAME, va);
+		*oldpte &= ~PTE_WRITE;
+		*newpte = *oldpte;
+	}
+	return 0;
+}
+
+/*
+ * Copy an address space for fork. Resident pages are not copied: the
+ * child's page table points at the parent's frames, both sides lose
+ * write permission, and the first write on either side makes a
+ * private copy (see vm_fault). Paged-out pages are read back into a
+ * frame for the child; the parent's copy stays in swap.
+ */
+int
+as_copy(struct addrspace *old, struct addrspace **ret)
+{
+	struct addrspace *new;
+	struct region *rg, *newrg;
+	unsigned i, num;
+	int result;
+
+	new = as_create();
+	if (new == NULL) {
+		return ENOMEM;
+	}
+	new->as_load_complete = old->as_load_complete;
+	new->as_heap = old->as_heap;
+	new->as_break = old->as_break;
+
+	vm_pagelock_acquire();
+
+	num = regionarray_num(&old->as_regions);
+	for (i=0; i<num; i++) {
+		rg = regionarray_get(&old->as_regions, i);
+		result = as_add_region(new, rg->rg_vbase, rg->rg_npages,
+				       rg->rg_flags, &newrg);
+		if (result) {
+			goto fail;
+		}
+		if (rg->rg_vnode != NULL) {
+			VOP_INCREF(rg->rg_vnode);
+			newrg->rg_vnode = rg->rg_vnode;
+			newrg->rg_offset = rg->rg_offset;
+			newrg->rg_filesz = rg->rg_filesz;
+		}
+		result = as_copy_pages(old, new, rg);
+		if (result) {
+			goto fail;
+		}
+	}
+	result = as_copy_pages(old, new, &old->as_heap);
+	if (result) {
+		goto fail;
+	}
+
+	/* The parent may still have writable entries for shared pages. */
+	vm_tlbinvalidate_all(&old->as_tlb);
+
+	vm_pagelock_release();
+
+	*ret = new;
+	return 0;
+
+ fail:
+	/* Pages already shared just stay copy-on-write in the parent. */
+	vm_tlbinvalidate_all(&old->as_tlb);
+	vm_pagelock_release();
+	as_destroy(new);
+	return result;
+}
+
+/*
+ * Release the frames and swap slots of NPAGES pages from VADDR and
+ * clear their entries. Call with the paging lock held.
+ */
+static
+void
+as_free_pages(struct addrspace *as, vaddr_t vaddr, size_t npages)
+{
+	pte_t *pte;
+	paddr_t pa;
+	size_t j;
+
+	for (j=0; j<npages; j++) {
+		pte = pt_lookup(as->as_pt, vaddr + j * PAGE_SIZE, false);
+		if (pte == NULL) {
+			continue;
+		}
+		vm_pagewait(pte);
+		vm_filewait(pte);
+		if (*pte & PTE_ZERO) {
+			/* Shared zero page; nothing to free. */
+		}
+		else if (*pte & PTE_VALID) {
+			pa = *pte & PTE_FRAME;
+			if ((*pte & PTE_FILE) && coremap_refcount(pa) == 1) {
+				/* Last mapping; drop it from the cache. */
+				pagecache_remove(pagecache_bypaddr(pa));
+			}
+			vm_pagedirty(pa);
+			coremap_free(pa);
+		}
+		else if (*pte & PTE_SWAPPED) {
+			swap_free(PTE_SLOT(*pte));
+		}
+		*pte = 0;
+	}
+}
+
+void
+as_destroy(struct addrspace *as)
+{
+	struct addrspace **asp;
+	struct region *rg;
+	unsigned i, num;
+
+	/* Keep pageout from picking our pages while we free them. */
+	vm_pagelock_acquire();
+	for (asp = &as_all; *asp != as; asp = &(*asp)->as_next) {
+		KASSERT(*asp != NULL);
+	}
+	*asp = as->as_next;
+	num = regionarray_num(&as->as_regions);
+	for (i=0; i<num; i++) {
+		rg = regionarray_get(&as->as_regions, i);
+		as_free_pages(as, rg->rg_vbase, rg->rg_npages);
+	}
+	as_free_pages(as, as->as_heap.rg_vbase, as->as_heap.rg_npages);
+	vm_pagelock_release();
+
+	/* Not under the paging lock; closing a file may sleep on I/O. */
+	for (i=0; i<num; i++) {
+		rg = regionarray_get(&as->as_regions, i);
+		if (rg->rg_vnode != NULL) {
+			VOP_DECREF(rg->rg_vnode);
+		}
+		kfree(rg);
+	}
+
+	regionarray_setsize(&as->as_regions, 0);
+	regionarray_cleanup(&as->as_regions);
+
+	pt_destroy(as->as_pt);
+	kfree(as);
+}
+
+void
+as_activate(struct addrspace *as)
+{
+	if (as == NULL) {
+		/*
+		 * Kernel thread; leave the TLB alone, but the page table
+		 * may be about to be destroyed.
+		 */
+		vm_tlbdeactivate();
+		return;
+	}
+	vm_tlbactivate(&as->as_tlb, as->as_pt);
+}
+
+void
+as_deactivate(void)
+{
+	/*
+	 * Nothing to do; entries of other address spaces are told
+	 * apart by ASID.
+	 */
+}
+
+/*
+ * Common part of as_define_region and as_define_file.
+ */
+static
+int
+as_define(struct addrspace *as, vaddr_t vaddr, size_t sz,
+	  int readable, int writeable, int executable, struct region **ret)
+{
+	unsigned flags;
+
+	/* Align the region. First, the base... */
+	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+
+	/* ...and now the length. */
+	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	flags = 0;
+	if (readable) {
+		flags |= RG_READ;
+	}
+	if (writeable) {
+		flags |= RG_WRITE;
+	}
+	if (executable) {
+		flags |= RG_EXEC;
+	}
+
+	return as_add_region(as, vaddr, sz / PAGE_SIZE, flags, ret);
+}
+
+int
+as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+		 int readable, int writeable, int executable)
+{
+	return as_define(as, vaddr, sz, readable, writeable, executable,
+			 NULL);
+}
+
+int
+as_define_file(struct addrspace *as, vaddr_t vaddr, size_t sz,
+	       size_t filesz, int readable, int writeable, int executable,
+	       struct vnode *vn, off_t offset)
+{
+	struct region *rg;
+	int result;
+
+	KASSERT(offset % PAGE_SIZE == vaddr % PAGE_SIZE);
+	KASSERT(filesz <= sz);
+
+	result = as_define(as, vaddr, sz, readable, writeable, executable,
+			   &rg);
+	if (result) {
+		return result;
+	}
+	VOP_INCREF(vn);
+	rg->rg_vnode = vn;
+	rg->rg_offset = offset - vaddr % PAGE_SIZE;
+	rg->rg_filesz = filesz + vaddr % PAGE_SIZE;
+	return 0;
+}
+
+int
+as_prepare_load(struct addrspace *as)
+{
+	/*
+	 * Let load_elf write into read-only segments until we're done.
+	 * Nothing is allocated here; vm_fault hands out zeroed pages as
+	 * they are first touched.
+	 */
+	as->as_load_complete = false;
+	return 0;
+}
+
+int
+as_complete_load(struct addrspace *as)
+{
+	struct region *rg;
+	unsigned i, num;
+	vaddr_t top;
+
+	as->as_load_complete = true;
+
+	/* The heap starts above everything the executable defined. */
+	top = 0;
+	num = regionarray_num(&as->as_regions);
+	for (i=0; i<num; i++) {
+		rg = regionarray_get(&as->as_regions, i);
+		if (rg->rg_vbase + rg->rg_npages * PAGE_SIZE > top) {
+			top = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		}
+	}
+	as->as_heap.rg_vbase = top;
+	as->as_heap.rg_npages = 0;
+	as->as_break = top;
+
+	/* Drop the writable TLB entries left over from loading. */
+	vm_tlbinvalidate_all(&as->as_tlb);
+	return 0;
+}
+
+int
+as_define_stack(struct addrspace *as, vaddr_t *stackptr)
+{
+	vaddr_t stackbase;
+	int result;
+
+	stackbase = USERSTACK - VM_STACKPAGES * PAGE_SIZE;
+	result = as_add_region(as, stackbase, VM_STACKPAGES,
+			       RG_READ | RG_WRITE | RG_STACK, NULL);
+	if (result) {
+		return result;
+	}
+
+	*stackptr = USERSTACK;
+	return 0;
+}
+
+/*
+ * Move the break. The heap region always covers the pages up to the
+ * break; pages in it are zero-filled on first touch like any other,
+ * and pages given back are freed right away rather than waiting for
+ * the process to exit.
+ */
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	struct region *rg;
+	vaddr_t oldbrk, newbrk, oldtop, newtop;
+	size_t npages;
+
+	rg = &as->as_heap;
+	oldbrk = as->as_break;
+	newbrk = oldbrk + amount;
+
+	if (amount < 0 && newbrk > oldbrk) {
+		return EINVAL;
+	}
+	if (amount > 0 && newbrk < oldbrk) {
+		return ENOMEM;
+	}
+	if (newbrk < rg->rg_vbase) {
+		return EINVAL;
+	}
+
+	npages = (newbrk - rg->rg_vbase + PAGE_SIZE - 1) / PAGE_SIZE;
+	oldtop = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+	newtop = rg->rg_vbase + npages * PAGE_SIZE;
+
+	if (npages > rg->rg_npages) {
+		if (npages > PROC_MAX_HEAP_PAGES || newtop > USERSPACETOP ||
+		    as_find_overlap(as, oldtop, newtop) != NULL) {
+			return ENOMEM;
+		}
+	}
+	else if (npages < rg->rg_npages) {
+		vm_pagelock_acquire();
+		as_free_pages(as, newtop, rg->rg_npages - npages);
+		vm_pagelock_release();
+
+		/* Nothing runs in this address space until we return. */
+		vm_tlbinvalidate_all(&as->as_tlb);
+	}
+
+	rg->rg_npages = npages;
+	as->as_break = newbrk;
+	*oldbreak = oldbrk;
+	return 0;
+}
+
+int
+as_mmap(struct addrspace *as, size_t len, unsigned flags,
+	struct vnode *vn, off_t offset, vaddr_t *ret)
+{
+	struct region *rg;
+	vaddr_t base, top, floor;
+	size_t npages;
+	int result;
+
+	KASSERT(offset % PAGE_SIZE == 0);
+
+	npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+	if (npages == 0 || npages > VM_MMAPTOP / PAGE_SIZE) {
+		return EINVAL;
+	}
+
+	/* Highest gap that fits, skipping down past whatever is in the way. */
+	floor = as->as_heap.rg_vbase + PROC_MAX_HEAP_PAGES * PAGE_SIZE;
+	top = VM_MMAPTOP;
+	while (true) {
+		if (top < floor || top - floor < npages * PAGE_SIZE) {
+			return ENOMEM;
+		}
+		base = top - npages * PAGE_SIZE;
+		rg = as_find_overlap(as, base, top);
+		if (rg == NULL) {
+			break;
+		}
+		top = rg->rg_vbase;
+	}
+
+	result = as_add_region(as, base, npages, flags | RG_MMAP, &rg);
+	if (result) {
+		return result;
+	}
+	VOP_INCREF(vn);
+	rg->rg_vnode = vn;
+	rg->rg_offset = offset;
+	rg->rg_filesz = npages * PAGE_SIZE;
+
+	*ret = base;
+	return 0;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	struct region *rg;
+	unsigned i, num;
+	size_t npages;
+
+	npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	num = regionarray_num(&as->as_regions);
+	for (i=0; i<num; i++) {
+		rg = regionarray_get(&as->as_regions, i);
+		if (rg->rg_vbase == vaddr && (rg->rg_flags & RG_MMAP)) {
+			break;
+		}
+	}
+	if (i == num || rg->rg_npages != npages) {
+		/* We don't split mappings. */
+		return EINVAL;
+	}
+
+	vm_pagelock_acquire();
+	as_free_pages(as, rg->rg_vbase, rg->rg_npages);
+	vm_pagelock_release();
+
+	/* Nothing runs in this address space until we return. */
+	vm_tlbinvalidate_all(&as->as_tlb);
+
+	regionarray_remove(&as->as_regions, i);
+	VOP_DECREF(rg->rg_vnode);
+	kfree(rg);
+	return 0;
+}
+
+/*
+ * Find the address space mapping frame PA at VADDR. For pageout, when
+ * a page that was shared is down to its last mapping.
+ */
+struct addrspace *
+as_findowner(paddr_t pa, vaddr_t vaddr)
+{
+	struct addrspace *as;
+	pte_t *pte;
+
+	for (as = as_all; as != NULL; as = as->as_next) {
+		pte = pt_lookup(as->as_pt, vaddr, false);
+		if (pte != NULL && (*pte & PTE_VALID) &&
+		    (*pte & PTE_FRAME) == pa) {
+			return as;
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,1059 @@
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <vm.h>
+#include <coremap.h>
+#include <kheap.h>
+
+/*
+ * Physical page allocator.
+ *
+ * Free frames are managed with a binary buddy allocator. A free block
+ * of order k is 2^k pages long and starts at a page number that is a
+ * multiple of 2^k; its buddy is the block of the same order whose page
+ * number differs only in bit k. Free block heads are kept on one
+ * doubly linked list per order, threaded through the coremap entries.
+ *
+ * To allocate N pages we take a block of the smallest order that
+ * holds N pages, splitting a larger block if needed, and give the
+ * unused tail back so a 5-page request costs 5 pages and not 8.
+ * Freeing a run splits it into aligned power-of-two blocks and
+ * coalesces each with its buddy for as long as the buddy is free.
+ * Both paths do O(log n) list operations.
+ *
+ * Single pages normally come from and go back to the per-cpu cache
+ * in curcpu->c_pagecache. Each cache has its own spinlock, which only
+ * its cpu takes, except when an allocation is about to fail: then the
+ * allocating cpu empties every cache into the buddy lists, in case
+ * pages sitting on other cpus would do (pcpu_drainall). Cached pages
+ * are marked CME_CACHED rather than CME_FREE so the buddy code never
+ * merges them; they are moved to and from the buddy lists
+ * COREMAP_PCPU_BATCH at a time.
+ *
+ * User pages can be shared copy-on-write between address spaces, so
+ * each page has a reference count; coremap_free only releases the
+ * page when the last reference goes away.
+ *
+ * For pageout, each user page also records the address space and
+ * address it is mapped at. Shared pages don't have a single owner, so
+ * their cme_as is cleared and they stay resident; their cme_vaddr is
+ * kept as long as every mapping uses the same address, as after fork.
+ * Once such a page is down to one reference again, the clock hands it
+ * out without an owner and the VM system finds the address space
+ * still mapping it there and records it (coremap_setowner); a fault
+ * on it does the same (coremap_adopt). A user page is
+ * pinned from allocation until the VM code has entered it in a page
+ * table, and while it is being paged out. A page that also has an
+ * up-to-date copy in swap records the slot, so that it can be dropped
+ * again without being written.
+ *
+ * Zeroing pages for first touch is done ahead of time where possible:
+ * the zero pool holds up to COREMAP_ZEROPAGES free frames, marked
+ * CME_ZEROED, that are already cleared. coremap_zerofill, run by a
+ * background thread, adds to it; coremap_alloc_zeroed takes from it.
+ * If everything else is used up, plain single-page allocations take
+ * zero pool pages too.
+ *
+ * Before coremap_bootstrap() runs we hand out memory with
+ * ram_stealmem(); those pages end up marked CME_FIXED and are never
+ * freed, since nothing recorded how long each run was.
+ */
+
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+
+static struct coremap_entry *coremap;
+static unsigned coremap_npages;		/* total frames covered */
+static unsigned coremap_firstfree;	/* first frame we manage */
+static unsigned coremap_freeheads[COREMAP_NORDERS];
+static unsigned coremap_nfreeblocks[COREMAP_NORDERS];
+static unsigned coremap_nfree;		/* free frames on buddy lists */
+static unsigned coremap_ncached;	/* free frames in per-cpu caches */
+static bool coremap_ready;
+static struct coremap_pcpu *coremap_pcpus;	/* all per-cpu caches */
+static unsigned coremap_hand;		/* where coremap_victim resumes */
+
+/* pre-zeroed pages, protected by coremap_lock */
+static paddr_t coremap_zeropool[COREMAP_ZEROPAGES];
+static unsigned coremap_nzeroed;	/* pages in coremap_zeropool */
+
+/* counters; the per-cpu caches keep their own deltas */
+static unsigned coremap_nkernel;
+static unsigned coremap_nuser;
+static unsigned coremap_zerohits;	/* zeroed pages handed out */
+static unsigned coremap_zeromisses;	/* ...wanted with the pool empty */
+static unsigned coremap_zerosteals;	/* ...used as plain pages */
+
+#define PADDR_TO_CMI(pa) ((unsigned)((pa) / PAGE_SIZE))
+#define CMI_TO_PADDR(i)  ((paddr_t)(i) * PAGE_SIZE)
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Free list handling. Only the head page of a free block is on a
+ * list; the rest of its pages are CME_FREE with no order.
+ */
+
+static
+void
+freelist_insert(unsigned i, unsigned order)
+{
+	struct coremap_entry *cme = &coremap[i];
+	unsigned head;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(order < COREMAP_NORDERS);
+	KASSERT((i & ((1U << order) - 1)) == 0);
+
+	head = coremap_freeheads[order];
+	cme->cme_order = order;
+	cme->cme_prev = CME_NONE;
+	cme->cme_next = head;
+	if (head != CME_NONE) {
+		coremap[head].cme_prev = i;
+	}
+	coremap_freeheads[order] = i;
+	coremap_nfreeblocks[order]++;
+}
+
+static
+void
+freelist_remove(unsigned i)
+{
+	struct coremap_entry *cme = &coremap[i];
+	unsigned order = cme->cme_order;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(cme->cme_state == CME_FREE);
+	KASSERT(order < COREMAP_NORDERS);
+
+	if (cme->cme_prev != CME_NONE) {
+		coremap[cme->cme_prev].cme_next = cme->cme_next;
+	}
+	else {
+		KASSERT(coremap_freeheads[order] == i);
+		coremap_freeheads[order] = cme->cme_next;
+	}
+	if (cme->cme_next != CME_NONE) {
+		coremap[cme->cme_next].cme_prev = cme->cme_prev;
+	}
+	cme->cme_next = cme->cme_prev = CME_NONE;
+	cme->cme_order = CME_NOORDER;
+	KASSERT(coremap_nfreeblocks[order] > 0);
+	coremap_nfreeblocks[order]--;
+}
+
+/*
+ * Mark NPAGES pages starting at I as belonging to a free block.
+ */
+static
+void
+mark_free(unsigned i, unsigned npages)
+{
+	unsigned j;
+
+	for (j=i; j<i+npages; j++) {
+		coremap[j].cme_state = CME_FREE;
+		coremap[j].cme_order = CME_NOORDER;
+		coremap[j].cme_npages = 0;
+		coremap[j].cme_as = NULL;
+		coremap[j].cme_vaddr = 0;
+		coremap[j].cme_refcount = 0;
+		coremap[j].cme_pinned = 0;
+		coremap[j].cme_swapslot = CME_NONE;
+		coremap[j].cme_heapref = NULL;
+	}
+}
+
+/*
+ * Free the block of 2^ORDER pages at I, merging with its buddy as
+ * far up as possible.
+ */
+static
+void
+buddy_freeblock(unsigned i, unsigned order)
+{
+	unsigned buddy;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	mark_free(i, 1U << order);
+	coremap_nfree += 1U << order;
+
+	while (order + 1 < COREMAP_NORDERS) {
+		buddy = i ^ (1U << order);
+		if (buddy >= coremap_npages ||
+		    coremap[buddy].cme_state != CME_FREE ||
+		    coremap[buddy].cme_order != order) {
+			break;
+		}
+		freelist_remove(buddy);
+		if (buddy < i) {
+			i = buddy;
+		}
+		order++;
+	}
+	freelist_insert(i, order);
+}
+
+/*
+ * Free an arbitrary run of pages by splitting it into aligned
+ * power-of-two blocks.
+ */
+static
+void
+buddy_freerange(unsigned i, unsigned npages)
+{
+	unsigned order;
+
+	while (npages > 0) {
+		order = 0;
+		while (order + 1 < COREMAP_NORDERS &&
+		       (i & ((2U << order) - 1)) == 0 &&
+		       (2U << order) <= npages) {
+			order++;
+		}
+		buddy_freeblock(i, order);
+		i += 1U << order;
+		npages -= 1U << order;
+	}
+}
+
+/*
+ * Take NPAGES pages out of the free blocks. Returns the first index,
+ * or CME_NONE.
+ */
+static
+unsigned
+buddy_alloc(unsigned long npages)
+{
+	unsigned want, order, i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	for (want = 0; (1UL << want) < npages; want++) {
+		if (want + 1 >= COREMAP_NORDERS) {
+			return CME_NONE;
+		}
+	}
+
+	for (order = want; order < COREMAP_NORDERS; order++) {
+		if (coremap_freeheads[order] != CME_NONE) {
+			break;
+		}
+	}
+	if (order == COREMAP_NORDERS) {
+		return CME_NONE;
+	}
+
+	i = coremap_freeheads[order];
+	freelist_remove(i);
+
+	/* split down, returning the upper halves */
+	while (order > want) {
+		order--;
+		freelist_insert(i + (1U << order), order);
+	}
+	coremap_nfree -= 1U << want;
+
+	/* give back the part of the block we don't need */
+	if (npages < (1UL << want)) {
+		buddy_freerange(i + npages, (1U << want) - npages);
+	}
+
+	return i;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Per-cpu page caches.
+ */
+
+void
+coremap_pcpu_init(struct coremap_pcpu *cp)
+{
+	spinlock_init(&cp->cp_lock);
+	cp->cp_count = 0;
+	cp->cp_hits = 0;
+	cp->cp_misses = 0;
+	cp->cp_refills = 0;
+	cp->cp_drains = 0;
+	cp->cp_nkernel = 0;
+	cp->cp_nuser = 0;
+
+	spinlock_acquire(&coremap_lock);
+	cp->cp_next = coremap_pcpus;
+	coremap_pcpus = cp;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Move up to COREMAP_PCPU_BATCH single pages from the buddy lists
+ * into CP. Call with CP's lock held.
+ */
+static
+void
+pcpu_refill(struct coremap_pcpu *cp)
+{
+	unsigned i, n;
+
+	KASSERT(spinlock_do_i_hold(&cp->cp_lock));
+
+	spinlock_acquire(&coremap_lock);
+	for (n=0; n<COREMAP_PCPU_BATCH &&
+		     cp->cp_count < COREMAP_PCPU_PAGES; n++) {
+		i = buddy_alloc(1);
+		if (i == CME_NONE) {
+			break;
+		}
+		coremap[i].cme_state = CME_CACHED;
+		cp->cp_pages[cp->cp_count++] = CMI_TO_PADDR(i);
+	}
+	coremap_ncached += n;
+	spinlock_release(&coremap_lock);
+	cp->cp_refills++;
+}
+
+/*
+ * Move up to NPAGES pages from CP back to the buddy lists. Call with
+ * CP's lock held.
+ */
+static
+void
+pcpu_drain(struct coremap_pcpu *cp, unsigned npages)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&cp->cp_lock));
+
+	spinlock_acquire(&coremap_lock);
+	while (npages > 0 && cp->cp_count > 0) {
+		i = PADDR_TO_CMI(cp->cp_pages[--cp->cp_count]);
+		KASSERT(coremap[i].cme_state == CME_CACHED);
+		buddy_freeblock(i, 0);
+		KASSERT(coremap_ncached > 0);
+		coremap_ncached--;
+		npages--;
+	}
+	spinlock_release(&coremap_lock);
+	cp->cp_drains++;
+}
+
+/*
+ * Single-page allocation from this cpu's cache.
+ */
+static
+paddr_t
+pcpu_alloc(struct addrspace *as, vaddr_t vaddr)
+{
+	struct coremap_pcpu *cp;
+	struct coremap_entry *cme;
+	paddr_t pa;
+	int spl;
+
+	spl = splhigh();
+	cp = &curcpu->c_self->c_pagecache;
+	spinlock_acquire(&cp->cp_lock);
+	if (cp->cp_count > 0) {
+		cp->cp_hits++;
+	}
+	else {
+		cp->cp_misses++;
+		pcpu_refill(cp);
+		if (cp->cp_count == 0) {
+			spinlock_release(&cp->cp_lock);
+			splx(spl);
+			return 0;
+		}
+	}
+	pa = cp->cp_pages[--cp->cp_count];
+
+	cme = &coremap[PADDR_TO_CMI(pa)];
+	KASSERT(cme->cme_state == CME_CACHED);
+	cme->cme_state = as == NULL ? CME_KERNEL : CME_USER;
+	cme->cme_as = as;
+	cme->cme_vaddr = vaddr;
+	cme->cme_npages = 1;
+	cme->cme_refcount = 1;
+	cme->cme_pinned = as != NULL;
+	cme->cme_swapslot = CME_NONE;
+	if (as == NULL) {
+		cp->cp_nkernel++;
+	}
+	else {
+		cp->cp_nuser++;
+	}
+	spinlock_release(&cp->cp_lock);
+	splx(spl);
+
+	return pa;
+}
+
+/*
+ * Return a single page to this cpu's cache, draining half of it
+ * first if it's full.
+ */
+static
+void
+pcpu_free(unsigned i)
+{
+	struct coremap_pcpu *cp;
+	struct coremap_entry *cme = &coremap[i];
+	int spl;
+
+	spl = splhigh();
+	cp = &curcpu->c_self->c_pagecache;
+	spinlock_acquire(&cp->cp_lock);
+	if (cp->cp_count == COREMAP_PCPU_PAGES) {
+		pcpu_drain(cp, COREMAP_PCPU_BATCH);
+	}
+	if (cme->cme_state == CME_KERNEL) {
+		cp->cp_nkernel--;
+	}
+	else {
+		cp->cp_nuser--;
+	}
+	cme->cme_state = CME_CACHED;
+	cme->cme_npages = 0;
+	cme->cme_as = NULL;
+	cme->cme_vaddr = 0;
+	cme->cme_refcount = 0;
+	cme->cme_pinned = 0;
+	cme->cme_swapslot = CME_NONE;
+	cp->cp_pages[cp->cp_count++] = CMI_TO_PADDR(i);
+	spinlock_release(&cp->cp_lock);
+	splx(spl);
+}
+
+/*
+ * Give back everything in every cpu's cache; used when an allocation
+ * is about to fail, in case pages cached elsewhere would do or would
+ * complete a block. Caches are never removed from the list, so it
+ * can be walked without coremap_lock, which we can't hold while
+ * taking a cache's lock.
+ */
+static
+void
+pcpu_drainall(void)
+{
+	struct coremap_pcpu *cp;
+
+	spinlock_acquire(&coremap_lock);
+	cp = coremap_pcpus;
+	spinlock_release(&coremap_lock);
+
+	for (; cp != NULL; cp = cp->cp_next) {
+		spinlock_acquire(&cp->cp_lock);
+		if (cp->cp_count > 0) {
+			pcpu_drain(cp, cp->cp_count);
+		}
+		spinlock_release(&cp->cp_lock);
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Zero pool.
+ */
+
+/*
+ * Hand out the most recently zeroed page (the one most likely to be
+ * in the cache). Call with coremap_lock held.
+ */
+static
+paddr_t
+zeropool_take(struct addrspace *as, vaddr_t vaddr)
+{
+	struct coremap_entry *cme;
+	paddr_t pa;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(coremap_nzeroed > 0);
+
+	pa = coremap_zeropool[--coremap_nzeroed];
+	cme = &coremap[PADDR_TO_CMI(pa)];
+	KASSERT(cme->cme_state == CME_ZEROED);
+	cme->cme_state = as == NULL ? CME_KERNEL : CME_USER;
+	cme->cme_as = as;
+	cme->cme_vaddr = vaddr;
+	cme->cme_npages = 1;
+	cme->cme_refcount = 1;
+	cme->cme_pinned = as != NULL;
+	cme->cme_swapslot = CME_NONE;
+	if (as == NULL) {
+		coremap_nkernel++;
+	}
+	else {
+		coremap_nuser++;
+	}
+	return pa;
+}
+
+/*
+ * Allocate a single page that is known to be zero-filled, for AS at
+ * VADDR as with coremap_alloc. Returns 0 if the zero pool is empty;
+ * the caller should then allocate and clear a page itself.
+ */
+paddr_t
+coremap_alloc_zeroed(struct addrspace *as, vaddr_t vaddr)
+{
+	paddr_t pa;
+
+	spinlock_acquire(&coremap_lock);
+	if (coremap_nzeroed == 0) {
+		coremap_zeromisses++;
+		spinlock_release(&coremap_lock);
+		return 0;
+	}
+	pa = zeropool_take(as, vaddr);
+	coremap_zerohits++;
+	spinlock_release(&coremap_lock);
+
+	return pa;
+}
+
+/*
+ * Move one free page into the zero pool, clearing it first. Returns
+ * false if the pool is full or there is no free page. Sleeps, or at
+ * least takes a while; only one thread should call this.
+ */
+bool
+coremap_zerofill(void)
+{
+	struct coremap_entry *cme;
+	unsigned i;
+	paddr_t pa;
+
+	spinlock_acquire(&coremap_lock);
+	if (coremap_nzeroed >= COREMAP_ZEROPAGES) {
+		spinlock_release(&coremap_lock);
+		return false;
+	}
+	i = buddy_alloc(1);
+	if (i == CME_NONE) {
+		spinlock_release(&coremap_lock);
+		return false;
+	}
+	/* Not on any list, so no one else will touch it meanwhile. */
+	cme = &coremap[i];
+	cme->cme_state = CME_ZEROED;
+	cme->cme_order = CME_NOORDER;
+	spinlock_release(&coremap_lock);
+
+	pa = CMI_TO_PADDR(i);
+	bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap_nzeroed < COREMAP_ZEROPAGES);
+	coremap_zeropool[coremap_nzeroed++] = pa;
+	spinlock_release(&coremap_lock);
+
+	return true;
+}
+
+/*
+ * Number of pages in the zero pool. Not locked, so only approximate.
+ */
+unsigned
+coremap_zeropages(void)
+{
+	return coremap_nzeroed;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Set up the coremap. We place the coremap itself at the bottom of
+ * the remaining free memory and mark everything below it fixed.
+ */
+void
+coremap_bootstrap(void)
+{
+	paddr_t lo, hi;
+	size_t cmsize;
+	unsigned i;
+
+	KASSERT(!coremap_ready);
+
+	ram_getsize(&lo, &hi);
+	KASSERT((lo & PAGE_FRAME) == lo);
+	KASSERT((hi & PAGE_FRAME) == hi);
+
+	coremap_npages = PADDR_TO_CMI(hi);
+	cmsize = ROUNDUP(coremap_npages * sizeof(struct coremap_entry),
+			 PAGE_SIZE);
+	if (lo + cmsize >= hi) {
+		panic("coremap: not enough memory for the coremap\n");
+	}
+	coremap = (struct coremap_entry *)PADDR_TO_KVADDR(lo);
+	lo += cmsize;
+
+	coremap_firstfree = PADDR_TO_CMI(lo);
+	coremap_hand = coremap_firstfree;
+	for (i=0; i<COREMAP_NORDERS; i++) {
+		coremap_freeheads[i] = CME_NONE;
+		coremap_nfreeblocks[i] = 0;
+	}
+	coremap_nfree = 0;
+
+	spinlock_acquire(&coremap_lock);
+	for (i=0; i<coremap_npages; i++) {
+		coremap[i].cme_state = CME_FIXED;
+		coremap[i].cme_order = CME_NOORDER;
+		coremap[i].cme_npages = 0;
+		coremap[i].cme_as = NULL;
+		coremap[i].cme_vaddr = 0;
+		coremap[i].cme_refcount = 0;
+		coremap[i].cme_pinned = 0;
+		coremap[i].cme_swapslot = CME_NONE;
+		coremap[i].cme_heapref = NULL;
+		coremap[i].cme_next = coremap[i].cme_prev = CME_NONE;
+	}
+	buddy_freerange(coremap_firstfree,
+			coremap_npages - coremap_firstfree);
+	coremap_ready = true;
+	spinlock_release(&coremap_lock);
+
+	kheap_bootstrap();
+
+	kprintf("coremap: %u pages, %u free, %uk for the map\n",
+		coremap_npages, coremap_nfree, cmsize / 1024);
+}
+
+/*
+ * Allocate NPAGES contiguous physical pages.
+ */
+paddr_t
+coremap_alloc(unsigned long npages, struct addrspace *as, vaddr_t vaddr)
+{
+	paddr_t pa;
+	unsigned i, first;
+
+	KASSERT(npages > 0);
+
+	if (!coremap_ready) {
+		/* still in early boot */
+		KASSERT(as == NULL);
+		spinlock_acquire(&coremap_lock);
+		pa = ram_stealmem(npages);
+		spinlock_release(&coremap_lock);
+		return pa;
+	}
+
+	if (npages == 1) {
+		pa = pcpu_alloc(as, vaddr);
+		if (pa == 0) {
+			/* Other cpus may be sitting on free pages. */
+			pcpu_drainall();
+			pa = pcpu_alloc(as, vaddr);
+		}
+		if (pa == 0) {
+			/* Last resort: a page someone zeroed for nothing. */
+			spinlock_acquire(&coremap_lock);
+			if (coremap_nzeroed > 0) {
+				pa = zeropool_take(as, vaddr);
+				coremap_zerosteals++;
+			}
+			spinlock_release(&coremap_lock);
+		}
+		DEBUG(DB_VM, "coremap: alloc 1 page at 0x%x\n", pa);
+		return pa;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	first = buddy_alloc(npages);
+	if (first == CME_NONE) {
+		spinlock_release(&coremap_lock);
+		pcpu_drainall();
+		spinlock_acquire(&coremap_lock);
+		first = buddy_alloc(npages);
+	}
+	if (first == CME_NONE) {
+		spinlock_release(&coremap_lock);
+		return 0;
+	}
+
+	for (i=first; i<first+npages; i++) {
+		coremap[i].cme_state = as == NULL ? CME_KERNEL : CME_USER;
+		coremap[i].cme_order = CME_NOORDER;
+		coremap[i].cme_as = as;
+		coremap[i].cme_vaddr =
+			as == NULL ? 0 : vaddr + (i - first) * PAGE_SIZE;
+		coremap[i].cme_npages = 0;
+		coremap[i].cme_refcount = 1;
+		coremap[i].cme_pinned = as != NULL;
+		coremap[i].cme_swapslot = CME_NONE;
+	}
+	coremap[first].cme_npages = npages;
+	if (as == NULL) {
+		coremap_nkernel += npages;
+	}
+	else {
+		coremap_nuser += npages;
+	}
+
+	spinlock_release(&coremap_lock);
+
+	pa = CMI_TO_PADDR(first);
+	DEBUG(DB_VM, "coremap: alloc %lu pages at 0x%x\n", npages, pa);
+	return pa;
+}
+
+/*
+ * Free a run of pages given its first page.
+ */
+void
+coremap_free(paddr_t paddr)
+{
+	unsigned i, first, npages;
+	unsigned char state;
+
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	if (!coremap_ready) {
+		/* Stolen with ram_stealmem, like CME_FIXED pages below. */
+		return;
+	}
+
+	first = PADDR_TO_CMI(paddr);
+	KASSERT(first < coremap_npages);
+
+	/* The caller owns the run, so we can look without the lock. */
+	state = coremap[first].cme_state;
+	if (state == CME_FIXED) {
+		/* stolen before bootstrap; we don't know its size */
+		return;
+	}
+	KASSERT(state == CME_KERNEL || state == CME_USER);
+
+	npages = coremap[first].cme_npages;
+	KASSERT(npages > 0);
+	KASSERT(first + npages <= coremap_npages);
+
+	/*
+	 * A count of 1 means nobody else can be taking a reference
+	 * right now, so only shared pages need the lock.
+	 */
+	KASSERT(coremap[first].cme_refcount > 0);
+	if (coremap[first].cme_refcount > 1) {
+		KASSERT(npages == 1);
+		spinlock_acquire(&coremap_lock);
+		if (--coremap[first].cme_refcount > 0) {
+			spinlock_release(&coremap_lock);
+			return;
+		}
+		spinlock_release(&coremap_lock);
+	}
+
+	/* The VM system must have let go of any copy in swap. */
+	KASSERT(coremap[first].cme_swapslot == CME_NONE);
+
+	if (npages == 1) {
+		pcpu_free(first);
+		return;
+	}
+
+	spinlock_acquire(&coremap_lock);
+
+	for (i=first; i<first+npages; i++) {
+		KASSERT(coremap[i].cme_state == state);
+	}
+	buddy_freerange(first, npages);
+	if (state == CME_KERNEL) {
+		coremap_nkernel -= npages;
+	}
+	else {
+		coremap_nuser -= npages;
+	}
+
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Take another reference to a single page, for sharing it between
+ * address spaces; the new mapping is at VADDR.
+ */
+void
+coremap_incref(paddr_t paddr, vaddr_t vaddr)
+{
+	struct coremap_entry *cme;
+
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+	KASSERT(PADDR_TO_CMI(paddr) < coremap_npages);
+
+	cme = &coremap[PADDR_TO_CMI(paddr)];
+	spinlock_acquire(&coremap_lock);
+	KASSERT(cme->cme_state == CME_USER);
+	KASSERT(cme->cme_npages == 1);
+	KASSERT(cme->cme_refcount > 0);
+	KASSERT(cme->cme_swapslot == CME_NONE);
+	cme->cme_refcount++;
+	/* We no longer know whose page table to fix up on pageout. */
+	cme->cme_as = NULL;
+	if (cme->cme_vaddr != vaddr) {
+		/* ...nor where to look for it. */
+		cme->cme_vaddr = 0;
+	}
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Number of references to a page. Only exact if the caller knows no
+ * one else is changing it; a count of 1 seen by a holder of one of
+ * the references is always exact.
+ */
+unsigned
+coremap_refcount(paddr_t paddr)
+{
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+	KASSERT(PADDR_TO_CMI(paddr) < coremap_npages);
+
+	return coremap[PADDR_TO_CMI(paddr)].cme_refcount;
+}
+
+/*
+ * Record that a single user page is now mapped only by AS at VADDR,
+ * e.g. once the other sharers of a copy-on-write page have gone.
+ */
+void
+coremap_setowner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	struct coremap_entry *cme;
+
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+	KASSERT(PADDR_TO_CMI(paddr) < coremap_npages);
+
+	cme = &coremap[PADDR_TO_CMI(paddr)];
+	spinlock_acquire(&coremap_lock);
+	KASSERT(cme->cme_state == CME_USER);
+	KASSERT(cme->cme_refcount == 1);
+	cme->cme_as = as;
+	cme->cme_vaddr = vaddr;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Record AS at VADDR as the owner of a user page, if it has just one
+ * reference, which must be that mapping, and no owner yet. For faults
+ * on pages whose other sharers have gone.
+ */
+void
+coremap_adopt(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	struct coremap_entry *cme;
+
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+	KASSERT(PADDR_TO_CMI(paddr) < coremap_npages);
+
+	cme = &coremap[PADDR_TO_CMI(paddr)];
+	spinlock_acquire(&coremap_lock);
+	KASSERT(cme->cme_state == CME_USER);
+	if (cme->cme_refcount == 1 && cme->cme_as == NULL) {
+		cme->cme_as = as;
+		cme->cme_vaddr = vaddr;
+	}
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Keep a user page from being chosen for pageout, without changing
+ * who owns it. Undone with coremap_unpin.
+ */
+void
+coremap_pin(paddr_t paddr)
+{
+	struct coremap_entry *cme;
+
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+	KASSERT(PADDR_TO_CMI(paddr) < coremap_npages);
+
+	cme = &coremap[PADDR_TO_CMI(paddr)];
+	spinlock_acquire(&coremap_lock);
+	KASSERT(cme->cme_state == CME_USER);
+	KASSERT(!cme->cme_pinned);
+	cme->cme_pinned = 1;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Let a user page be chosen for pageout again.
+ */
+void
+coremap_unpin(paddr_t paddr)
+{
+	struct coremap_entry *cme;
+
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+	KASSERT(PADDR_TO_CMI(paddr) < coremap_npages);
+
+	cme = &coremap[PADDR_TO_CMI(paddr)];
+	spinlock_acquire(&coremap_lock);
+	KASSERT(cme->cme_state == CME_USER);
+	KASSERT(cme->cme_pinned);
+	cme->cme_pinned = 0;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Swap slot holding a copy of a user page, or CME_NONE. Only
+ * meaningful to the VM system, which does its own locking.
+ */
+unsigned
+coremap_swapslot(paddr_t paddr)
+{
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+	KASSERT(PADDR_TO_CMI(paddr) < coremap_npages);
+
+	return coremap[PADDR_TO_CMI(paddr)].cme_swapslot;
+}
+
+void
+coremap_setswapslot(paddr_t paddr, unsigned slot)
+{
+	struct coremap_entry *cme;
+
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+	KASSERT(PADDR_TO_CMI(paddr) < coremap_npages);
+
+	cme = &coremap[PADDR_TO_CMI(paddr)];
+	KASSERT(cme->cme_state == CME_USER);
+	KASSERT(slot == CME_NONE || cme->cme_refcount == 1);
+	cme->cme_swapslot = slot;
+}
+
+/*
+ * The kernel heap records the bookkeeping for each of its subpage
+ * pages here, so kfree can go straight from a block to it. The entry
+ * belongs to whoever owns the page, so no locking here.
+ */
+void *
+coremap_heapref(paddr_t paddr)
+{
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	if (!coremap_ready) {
+		return NULL;
+	}
+	KASSERT(PADDR_TO_CMI(paddr) < coremap_npages);
+	return coremap[PADDR_TO_CMI(paddr)].cme_heapref;
+}
+
+void
+coremap_setheapref(paddr_t paddr, void *ref)
+{
+	struct coremap_entry *cme;
+
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	if (!coremap_ready) {
+		/* kheap_bootstrap catches up on these */
+		return;
+	}
+	KASSERT(PADDR_TO_CMI(paddr) < coremap_npages);
+	cme = &coremap[PADDR_TO_CMI(paddr)];
+	KASSERT(cme->cme_state == CME_KERNEL || cme->cme_state == CME_FIXED);
+	cme->cme_heapref = ref;
+}
+
+/*
+ * Advance the clock hand to the next page that could be paged out:
+ * one mapped by exactly one address space and not pinned. Successive
+ * calls go round all of memory, so the caller can give recently used
+ * pages a second chance by passing them over. The page comes back
+ * pinned, with its owner in AS_RET and VADDR_RET; for a page that was
+ * shared until lately, AS_RET is NULL and the caller must find the
+ * owner mapping it at VADDR_RET itself. Returns 0 if there is no such
+ * page.
+ */
+paddr_t
+coremap_victim(struct addrspace **as_ret, vaddr_t *vaddr_ret)
+{
+	struct coremap_entry *cme;
+	unsigned i, n;
+
+	spinlock_acquire(&coremap_lock);
+	for (n=0; n<coremap_npages; n++) {
+		i = coremap_hand++;
+		if (coremap_hand >= coremap_npages) {
+			coremap_hand = coremap_firstfree;
+		}
+		if (i < coremap_firstfree) {
+			continue;
+		}
+		cme = &coremap[i];
+		if (cme->cme_state != CME_USER || cme->cme_pinned ||
+		    cme->cme_refcount != 1 ||
+		    (cme->cme_as == NULL && cme->cme_vaddr == 0)) {
+			continue;
+		}
+		cme->cme_pinned = 1;
+		*as_ret = cme->cme_as;
+		*vaddr_ret = cme->cme_vaddr;
+		spinlock_release(&coremap_lock);
+		return CMI_TO_PADDR(i);
+	}
+	spinlock_release(&coremap_lock);
+	return 0;
+}
+
+/*
+ * Free frames, whether on the buddy lists or in per-cpu caches, not
+ * counting the zero pool. Not locked, so only approximate.
+ */
+unsigned
+coremap_freepages(void)
+{
+	return coremap_nfree + coremap_ncached;
+}
+
+/*
+ * Frames managed by the coremap, not counting early boot memory.
+ */
+unsigned
+coremap_totalpages(void)
+{
+	return coremap_npages - coremap_firstfree;
+}
+
+void
+coremap_printstats(void)
+{
+	struct coremap_pcpu *cp;
+	unsigned i, hits, misses, refills, drains;
+	int nkernel, nuser;
+
+	spinlock_acquire(&coremap_lock);
+	hits = misses = refills = drains = 0;
+	nkernel = coremap_nkernel;
+	nuser = coremap_nuser;
+	for (cp = coremap_pcpus; cp != NULL; cp = cp->cp_next) {
+		/* these are racy, but only counters */
+		hits += cp->cp_hits;
+		misses += cp->cp_misses;
+		refills += cp->cp_refills;
+		drains += cp->cp_drains;
+		nkernel += cp->cp_nkernel;
+		nuser += cp->cp_nuser;
+	}
+	kprintf("coremap: %u pages total, %u fixed\n",
+		coremap_npages, coremap_firstfree);
+	kprintf("coremap: %u free, %u cached, %d kernel, %d user\n",
+		coremap_nfree, coremap_ncached, nkernel, nuser);
+	kprintf("coremap: per-cpu cache %u hits, %u misses (%u%% hit), "
+		"%u refills, %u drains\n", hits, misses,
+		hits + misses == 0 ? 0 : (100 * hits) / (hits + misses),
+		refills, drains);
+	kprintf("coremap: zero pool %u/%u, %u hits, %u misses, %u stolen\n",
+		coremap_nzeroed, COREMAP_ZEROPAGES, coremap_zerohits,
+		coremap_zeromisses, coremap_zerosteals);
+	kprintf("coremap: free blocks by order:");
+	for (i=0; i<COREMAP_NORDERS; i++) {
+		kprintf(" %u", coremap_nfreeblocks[i]);
+	}
+	kprintf("\n");
+	spinlock_release(&coremap_lock);
+}
@@ -30,6 +30,11 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <coremap.h>
+#include <kheap.h>
 #include <vm.h>
 
 /*
@@ -121,6 +126,16 @@ fill_deadbeef(void *vptr, size_t len)
 #undef CHECKBEEF
 #undef CHECKGUARDS
 
+/*
+ * The per-cpu block caches (see kheap.h) hand out and take back
+ * blocks without going through subpage_kmalloc and subpage_kfree,
+ * which is where the checks above live, so they are turned off when
+ * any of those are on.
+ */
+#if !defined(SLOW) && !defined(GUARDS) && !defined(LABELS)
+#define PCPU_CACHE
+#endif
+
 ////////////////////////////////////////
 
 #if PAGE_SIZE == 4096
@@ -137,6 +152,10 @@ static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
 #error "Odd page size"
 #endif
 
+#if NSIZES > KHEAP_NSIZES
+#error "KHEAP_NSIZES is too small for sizes[]"
+#endif
+
 ////////////////////////////////////////
 
 struct freelist {
@@ -145,7 +164,7 @@ struct freelist {
 
 struct pageref {
 	struct pageref *next_samesize;
-	struct pageref *next_all;
+	struct pageref *prev_samesize;
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
 	uint16_t nfree;
@@ -160,68 +179,60 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the heap pages and their lists. Most small
+ * allocations and frees never take it: they are served from per-cpu
+ * block caches, which only come here to refill or drain in batches.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
+static struct kheap_pcpu *kheap_pcpus;	/* all per-cpu caches */
+
 ////////////////////////////////////////
 
 /*
- * We can only allocate whole pages of pageref structure at a time.
- * This is a struct type for such a page.
+ * Pagerefs are kept in whole pages of their own. Each such page
+ * starts with a header holding its bitmap of entries in use, and the
+ * pages are chained together, so the heap isn't limited to a fixed
+ * number of pages: another pageref page is added whenever the ones
+ * we have are full. A pageref page with nothing in use is kept until
+ * kheap_reclaim gives it back.
  *
- * Each pageref page contains 256 pagerefs, which can manage up to
- * 256 * 4K = 1M of kernel heap.
+ * Each pageref page contains 252 pagerefs, which can manage up to
+ * 252 * 4K = 1008K of kernel heap.
  */
 
-#define NPAGEREFS_PER_PAGE (PAGE_SIZE / sizeof(struct pageref))
+#define PAGEREFPAGE_HEADER 64	/* room for the fields before refs[] */
+#define NPAGEREFS_PER_PAGE \
+	((PAGE_SIZE - PAGEREFPAGE_HEADER) / sizeof(struct pageref))
+#define INUSE_WORDS ((NPAGEREFS_PER_PAGE + 31) / 32)
 
 struct pagerefpage {
-	struct pageref refs[NPAGEREFS_PER_PAGE];
-};
-
-/*
- * This structure holds a pointer to a pageref page and also its
- * bitmap of free entries.
- */
-
-#define INUSE_WORDS (NPAGEREFS_PER_PAGE / 32)
-
-struct kheap_root {
-	struct pagerefpage *page;
-	uint32_t pagerefs_inuse[INUSE_WORDS];
+	struct pagerefpage *next;	/* all pageref pages */
 	unsigned numinuse;
+	uint32_t pagerefs_inuse[INUSE_WORDS];
+	struct pageref refs[NPAGEREFS_PER_PAGE];
 };
 
-/*
- * It would be better to make this dynamically sizeable. However,
- * since we only actually run on System/161 and System/161 is
- * specifically limited to 16M of RAM, we'll just adopt that as a
- * static size limit.
- *
- * FUTURE: it would be better to pick this number based on the RAM
- * size we find at boot time.
- */
-
-#define NUM_PAGEREFPAGES 16
-#define TOTAL_PAGEREFS (NUM_PAGEREFPAGES * NPAGEREFS_PER_PAGE)
+/* The pageref page a pageref is on */
+#define PR_REFPAGE(pr) ((struct pagerefpage *)((vaddr_t)(pr) & PAGE_FRAME))
 
-static struct kheap_root kheaproots[NUM_PAGEREFPAGES];
+static struct pagerefpage *pagerefpages;
+static unsigned npagerefpages;
 
 /*
- * Allocate a page to hold pagerefs.
+ * Allocate another page to hold pagerefs and add it to the chain.
+ * Returns NULL if out of memory.
  */
 static
-void
-allocpagerefpage(struct kheap_root *root)
+struct pagerefpage *
+allocpagerefpage(void)
 {
+	struct pagerefpage *page;
 	vaddr_t va;
+	unsigned i;
 
-	KASSERT(root->page == NULL);
+	COMPILE_ASSERT(sizeof(struct pagerefpage) <= PAGE_SIZE);
 
 	/*
 	 * We release the spinlock while calling alloc_kpages. This
@@ -233,21 +244,23 @@ allocpagerefpage(struct kheap_root *root)
 	spinlock_acquire(&kmalloc_spinlock);
 	if (va == 0) {
 		kprintf("kmalloc: Couldn't get a pageref page\n");
-		return;
+		return NULL;
 	}
 	KASSERT(va % PAGE_SIZE == 0);
 
-	if (root->page != NULL) {
-		/* Oops, somebody else allocated it. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(va);
-		spinlock_acquire(&kmalloc_spinlock);
-		/* Once allocated it isn't ever freed. */
-		KASSERT(root->page != NULL);
-		return;
+	/*
+	 * If somebody else added a page meanwhile, we may end up with
+	 * one more than we need; kheap_reclaim will take it back.
+	 */
+	page = (struct pagerefpage *)va;
+	page->numinuse = 0;
+	for (i=0; i<INUSE_WORDS; i++) {
+		page->pagerefs_inuse[i] = 0;
 	}
-
-	root->page = (struct pagerefpage *)va;
+	page->next = pagerefpages;
+	pagerefpages = page;
+	npagerefpages++;
+	return page;
 }
 
 /*
@@ -259,41 +272,49 @@ allocpageref(void)
 {
 	unsigned i,j;
 	uint32_t k;
-	unsigned whichroot;
-	struct kheap_root *root;
+	struct pagerefpage *page;
 
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
-		if (root->numinuse >= NPAGEREFS_PER_PAGE) {
-			continue;
-		}
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-		/*
-		 * This should probably not be a linear search.
-		 */
-		for (i=0; i<INUSE_WORDS; i++) {
-			if (root->pagerefs_inuse[i]==0xffffffff) {
-				/* full */
-				continue;
+	while (1) {
+		for (page = pagerefpages; page != NULL; page = page->next) {
+			if (page->numinuse < NPAGEREFS_PER_PAGE) {
+				break;
 			}
-			for (k=1,j=0; k!=0; k<<=1,j++) {
-				if ((root->pagerefs_inuse[i] & k)==0) {
-					root->pagerefs_inuse[i] |= k;
-					root->numinuse++;
-					if (root->page == NULL) {
-						allocpagerefpage(root);
-					}
-					if (root->page == NULL) {
-						return NULL;
-					}
-					return &root->page->refs[i*32 + j];
-				}
+		}
+		if (page != NULL) {
+			break;
+		}
+		/* All full; add a page, and look again. */
+		if (allocpagerefpage() == NULL) {
+			return NULL;
+		}
+	}
+
+	/*
+	 * This should probably not be a linear search.
+	 *
+	 * The last bitmap word has bits past the end of refs[], but
+	 * since the page isn't full, we always find a real entry first.
+	 */
+	for (i=0; i<INUSE_WORDS; i++) {
+		if (page->pagerefs_inuse[i]==0xffffffff) {
+			/* full */
+			continue;
+		}
+		for (k=1,j=0; k!=0; k<<=1,j++) {
+			if ((page->pagerefs_inuse[i] & k)==0) {
+				KASSERT(i*32 + j < NPAGEREFS_PER_PAGE);
+				page->pagerefs_inuse[i] |= k;
+				page->numinuse++;
+				return &page->refs[i*32 + j];
 			}
-			KASSERT(0);
 		}
+		KASSERT(0);
 	}
 
-	/* ran out */
+	/* numinuse was wrong */
+	panic("kmalloc: pageref page %p has no free entries\n", page);
 	return NULL;
 }
 
@@ -306,44 +327,139 @@ freepageref(struct pageref *p)
 {
 	size_t i, j;
 	uint32_t k;
-	unsigned whichroot;
-	struct kheap_root *root;
 	struct pagerefpage *page;
 
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-		page = root->page;
-		if (page == NULL) {
-			KASSERT(root->numinuse == 0);
-			continue;
-		}
+	page = PR_REFPAGE(p);
+	j = p-page->refs;
+	/* note: j is unsigned, don't test < 0 */
+	KASSERT(j < NPAGEREFS_PER_PAGE);
+
+	i = j/32;
+	k = ((uint32_t)1) << (j%32);
+	KASSERT((page->pagerefs_inuse[i] & k) != 0);
+	page->pagerefs_inuse[i] &= ~k;
+	KASSERT(page->numinuse > 0);
+	page->numinuse--;
+}
+
+////////////////////////////////////////
+
+/*
+ * A pageref is on the list for its block size exactly when its page
+ * has some blocks free and some not, so allocation can always use the
+ * head. Pages with every block free are on a second list per size
+ * instead, which is only used when the first is empty; up to
+ * EMPTY_RESERVE of them are kept, to save handing pages back and
+ * forth when usage hovers around a page boundary, and any more are
+ * given back to the page allocator. Full pages are on no list.
+ *
+ * The coremap leads from a block to its pageref (once kheap_bootstrap
+ * has run), and walking all heap pages, which only stats and
+ * debugging need, is done via the pageref pages.
+ */
+#define EMPTY_RESERVE 2
+
+static struct pageref *sizebases[NSIZES];
+static struct pageref *emptybases[NSIZES];
+static unsigned nempty[NSIZES];		/* pages on emptybases[] */
 
-		j = p-page->refs;
-		/* note: j is unsigned, don't test < 0 */
-		if (j < NPAGEREFS_PER_PAGE) {
-			/* on this page */
-			i = j/32;
-			k = ((uint32_t)1) << (j%32);
-			KASSERT((root->pagerefs_inuse[i] & k) != 0);
-			root->pagerefs_inuse[i] &= ~k;
-			KASSERT(root->numinuse > 0);
-			root->numinuse--;
-			return;
+static unsigned kheap_nreclaimed;	/* pages given back by kheap_reclaim */
+
+/* True once every heap page's pageref is recorded in the coremap. */
+static bool kheap_tagged;
+
+/*
+ * Return the first pageref in use after PR, or the first of all if
+ * PR is NULL, or NULL at the end. For walking all heap pages.
+ */
+static
+struct pageref *
+pageref_next(struct pageref *pr)
+{
+	struct pagerefpage *page;
+	unsigned j;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	if (pr == NULL) {
+		page = pagerefpages;
+		j = 0;
+	}
+	else {
+		page = PR_REFPAGE(pr);
+		j = pr - page->refs + 1;
+	}
+	for (; page != NULL; page = page->next, j = 0) {
+		for (; j < NPAGEREFS_PER_PAGE; j++) {
+			if (page->pagerefs_inuse[j/32] &
+			    ((uint32_t)1 << (j%32))) {
+				return &page->refs[j];
+			}
 		}
 	}
-	/* pageref wasn't on any of the pages */
-	KASSERT(0);
+	return NULL;
 }
 
-////////////////////////////////////////
+/*
+ * Put PR at the head of the list *HEAD.
+ */
+static
+void
+pagelist_add(struct pageref **head, struct pageref *pr)
+{
+	pr->prev_samesize = NULL;
+	pr->next_samesize = *head;
+	if (*head != NULL) {
+		(*head)->prev_samesize = pr;
+	}
+	*head = pr;
+}
 
 /*
- * Each pageref is on two linked lists: one list of pages of blocks of
- * that same size, and one of all blocks.
+ * Take PR off the list *HEAD.
  */
-static struct pageref *sizebases[NSIZES];
-static struct pageref *allbase;
+static
+void
+pagelist_remove(struct pageref **head, struct pageref *pr)
+{
+	if (pr->prev_samesize != NULL) {
+		pr->prev_samesize->next_samesize = pr->next_samesize;
+	}
+	else {
+		KASSERT(*head == pr);
+		*head = pr->next_samesize;
+	}
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = pr->prev_samesize;
+	}
+	pr->next_samesize = pr->prev_samesize = NULL;
+}
+
+/*
+ * Return a page of type BLKTYPE with a free block, or NULL if there
+ * is none. Partly used pages are preferred, so that empty ones stay
+ * empty and can be given back.
+ */
+static
+struct pageref *
+subpage_getpage(unsigned blktype)
+{
+	struct pageref *pr;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	pr = sizebases[blktype];
+	if (pr == NULL && emptybases[blktype] != NULL) {
+		pr = emptybases[blktype];
+		pagelist_remove(&emptybases[blktype], pr);
+		KASSERT(nempty[blktype] > 0);
+		nempty[blktype]--;
+		pagelist_add(&sizebases[blktype], pr);
+	}
+	return pr;
+}
 
 ////////////////////////////////////////
 
@@ -573,14 +689,14 @@ checksubpage(struct pageref *pr)
 #ifdef SLOWER
 /*
  * Run checksubpage on all heap pages. This also checks that the
- * linked lists of pagerefs are more or less intact.
+ * lists of pages with free blocks are more or less intact.
  */
 static
 void
 checksubpages(void)
 {
 	struct pageref *pr;
-	int i;
+	unsigned i, ne;
 	unsigned sc=0, ac=0;
 
 	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
@@ -588,15 +704,29 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < TOTAL_PAGEREFS);
+			KASSERT(PR_BLOCKTYPE(pr) == i);
+			KASSERT(pr->nfree > 0);
+			KASSERT(pr->nfree < PAGE_SIZE / sizes[i]);
+			KASSERT(sc < npagerefpages * NPAGEREFS_PER_PAGE);
+			sc++;
+		}
+		ne = 0;
+		for (pr = emptybases[i]; pr != NULL; pr = pr->next_samesize) {
+			checksubpage(pr);
+			KASSERT(PR_BLOCKTYPE(pr) == i);
+			KASSERT(pr->nfree == PAGE_SIZE / sizes[i]);
+			KASSERT(ne < EMPTY_RESERVE);
+			ne++;
 			sc++;
 		}
+		KASSERT(ne == nempty[i]);
 	}
 
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+	for (pr = pageref_next(NULL); pr != NULL; pr = pageref_next(pr)) {
 		checksubpage(pr);
-		KASSERT(ac < TOTAL_PAGEREFS);
-		ac++;
+		if (pr->nfree > 0) {
+			ac++;
+		}
 	}
 
 	KASSERT(sc==ac);
@@ -681,13 +811,10 @@ void
 dump_subpages(unsigned generation)
 {
 	struct pageref *pr;
-	int i;
 
 	kprintf("Remaining allocations from generation %u:\n", generation);
-	for (i=0; i<NSIZES; i++) {
-		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
-			dump_subpage(pr, generation);
-		}
+	for (pr = pageref_next(NULL); pr != NULL; pr = pageref_next(pr)) {
+		dump_subpage(pr, generation);
 	}
 }
 
@@ -794,6 +921,8 @@ subpage_stats(struct pageref *pr)
 	kprintf("\n");
 }
 
+static void kmem_printstats(void);
+
 /*
  * Print the whole heap.
  */
@@ -801,49 +930,51 @@ void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+	struct kheap_pcpu *kp;
+	unsigned i, kept, hits, misses, refills, drains, cached;
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 
 	kprintf("Subpage allocator status:\n");
 
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+	for (pr = pageref_next(NULL); pr != NULL; pr = pageref_next(pr)) {
 		subpage_stats(pr);
 	}
 
-	spinlock_release(&kmalloc_spinlock);
-}
-
-////////////////////////////////////////
-
-/*
- * Remove a pageref from both lists that it's on.
- */
-static
-void
-remove_lists(struct pageref *pr, int blktype)
-{
-	struct pageref **guy;
-
-	KASSERT(blktype>=0 && blktype<NSIZES);
-
-	for (guy = &sizebases[blktype]; *guy; guy = &(*guy)->next_samesize) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_samesize;
-			break;
-		}
+	kept = 0;
+	for (i=0; i<NSIZES; i++) {
+		kept += nempty[i];
 	}
-
-	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_all;
-			break;
+	kprintf("Empty pages kept: %u; pages reclaimed: %u; "
+		"pageref pages: %u\n", kept, kheap_nreclaimed,
+		npagerefpages);
+
+	hits = misses = refills = drains = cached = 0;
+	for (kp = kheap_pcpus; kp != NULL; kp = kp->kp_next) {
+		/* these are racy, but only counters */
+		hits += kp->kp_hits;
+		misses += kp->kp_misses;
+		refills += kp->kp_refills;
+		drains += kp->kp_drains;
+		for (i=0; i<NSIZES; i++) {
+			cached += kp->kp_count[i];
 		}
 	}
+	kprintf("Per-cpu caches: %u blocks cached (shown as allocated)\n",
+		cached);
+	kprintf("Per-cpu caches: %u hits, %u misses (%u%% hit), "
+		"%u refills, %u drains\n", hits, misses,
+		hits + misses == 0 ? 0 : (100 * hits) / (hits + misses),
+		refills, drains);
+
+	kmem_printstats();
+
+	spinlock_release(&kmalloc_spinlock);
 }
 
+////////////////////////////////////////
+
 /*
  * Given a requested client size, return the block type, that is, the
  * index into the sizes[] array for the block size to use.
@@ -866,6 +997,44 @@ int blocktype(size_t clientsz)
 	return 0;
 }
 
+/*
+ * Take the first block off PR's free list, which must not be empty.
+ * A page that fills up leaves its size list.
+ */
+static
+void *
+subpage_take(struct pageref *pr)
+{
+	vaddr_t prpage, fla;
+	struct freelist *fl;
+	void *retptr;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+		pagelist_remove(&sizebases[PR_BLOCKTYPE(pr)], pr);
+	}
+	return retptr;
+}
+
 /*
  * Allocate a block of size SZ, where SZ is not large enough to
  * warrant a whole-page allocation.
@@ -911,47 +1080,27 @@ subpage_kmalloc(size_t sz
 
 	checksubpages();
 
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+	pr = subpage_getpage(blktype);
+	if (pr != NULL) {
 
 		/* check for corruption */
 		KASSERT(PR_BLOCKTYPE(pr) == blktype);
 		checksubpage(pr);
 
-		if (pr->nfree > 0) {
-
-		doalloc: /* comes here after getting a whole fresh page */
+	doalloc: /* comes here after getting a whole fresh page */
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+		retptr = subpage_take(pr);
 #ifdef GUARDS
-			retptr = establishguardband(retptr, clientsz, sz);
+		retptr = establishguardband(retptr, clientsz, sz);
 #endif
 #ifdef LABELS
-			retptr = establishlabel(retptr, label);
+		retptr = establishlabel(retptr, label);
 #endif
 
-			checksubpages();
+		checksubpages();
 
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
-		}
+		spinlock_release(&kmalloc_spinlock);
+		return retptr;
 	}
 
 	/*
@@ -1007,16 +1156,143 @@ subpage_kmalloc(size_t sz
 	pr->freelist_offset = fla - prpage;
 	KASSERT(pr->freelist_offset == (pr->nfree-1)*sizes[blktype]);
 
-	pr->next_samesize = sizebases[blktype];
-	sizebases[blktype] = pr;
+	pagelist_add(&sizebases[blktype], pr);
 
-	pr->next_all = allbase;
-	allbase = pr;
+	/* Let kfree find the pageref without searching. */
+	coremap_setheapref(KVADDR_TO_PADDR(prpage), pr);
 
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
 
+/*
+ * Find the pageref for the heap page containing PTRADDR, or return
+ * NULL if it is not one of ours. This is a coremap lookup, except in
+ * early boot when there are only a few pages to search.
+ */
+static
+struct pageref *
+subpage_lookup(vaddr_t ptraddr)
+{
+	struct pageref *pr;
+	vaddr_t prpage;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	prpage = ptraddr & PAGE_FRAME;
+	if (kheap_tagged) {
+		pr = coremap_heapref(KVADDR_TO_PADDR(prpage));
+		if (pr != NULL) {
+			/* check for corruption */
+			KASSERT(PR_PAGEADDR(pr) == prpage);
+			KASSERT(PR_BLOCKTYPE(pr) < NSIZES);
+			checksubpage(pr);
+		}
+		return pr;
+	}
+
+	for (pr = pageref_next(NULL); pr != NULL; pr = pageref_next(pr)) {
+		if (PR_PAGEADDR(pr) == prpage) {
+			/* check for corruption */
+			KASSERT(PR_BLOCKTYPE(pr) < NSIZES);
+			checksubpage(pr);
+			return pr;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Record the pagerefs of heap pages allocated before the coremap
+ * existed, so subpage_lookup need never search again.
+ */
+void
+kheap_bootstrap(void)
+{
+	struct pageref *pr;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	KASSERT(!kheap_tagged);
+	for (pr = pageref_next(NULL); pr != NULL; pr = pageref_next(pr)) {
+		coremap_setheapref(KVADDR_TO_PADDR(PR_PAGEADDR(pr)), pr);
+	}
+	kheap_tagged = true;
+	spinlock_release(&kmalloc_spinlock);
+}
+
+/*
+ * Put the block at PTRADDR back on the free list of its page PR. If
+ * that makes the whole page free and the reserve of empty pages of
+ * its size is full, take the page off the lists and return its
+ * address, which the caller must pass to free_kpages after releasing
+ * kmalloc_spinlock; otherwise return 0.
+ */
+static
+vaddr_t
+subpage_release(struct pageref *pr, vaddr_t ptraddr)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	vaddr_t offset;		// offset into page
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	offset = ptraddr - prpage;
+	KASSERT(offset < PAGE_SIZE && offset % sizes[blktype] == 0);
+
+	/*
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
+	 */
+
+	fla = prpage + offset;
+	fl = (struct freelist *)fla;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		/* page was full; it has a free block again */
+		KASSERT(pr->nfree == 0);
+		fl->next = NULL;
+		pagelist_add(&sizebases[blktype], pr);
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+
+		/* this block should not already be on the free list! */
+#ifdef SLOW
+		{
+			struct freelist *fl2;
+
+			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
+				KASSERT(fl2 != fl);
+			}
+		}
+#else
+		/* check just the head */
+		KASSERT(fl != fl->next);
+#endif
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
+
+	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pr->nfree < PAGE_SIZE / sizes[blktype]) {
+		return 0;
+	}
+
+	/* Whole page is free. Keep it if the reserve isn't full. */
+	pagelist_remove(&sizebases[blktype], pr);
+	if (nempty[blktype] < EMPTY_RESERVE) {
+		pagelist_add(&emptybases[blktype], pr);
+		nempty[blktype]++;
+		return 0;
+	}
+	freepageref(pr);
+	coremap_setheapref(KVADDR_TO_PADDR(prpage), NULL);
+	return prpage;
+}
+
 /*
  * Free a pointer previously returned from subpage_kmalloc. If the
  * pointer is not on any heap page we recognize, return -1.
@@ -1029,9 +1305,8 @@ subpage_kfree(void *ptr)
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
+	vaddr_t freepage;	// page to give back, or 0
 #ifdef GUARDS
 	size_t blocksize, smallerblocksize;
 #endif
@@ -1065,30 +1340,15 @@ subpage_kfree(void *ptr)
 
 	checksubpages();
 
-	/* Silence warnings with gcc 4.8 -Og (but not -O2) */
-	prpage = 0;
-	blktype = 0;
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	pr = subpage_lookup(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
 		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
@@ -1108,55 +1368,936 @@ subpage_kfree(void *ptr)
 	 */
 	fill_deadbeef((void *)ptraddr, sizes[blktype]);
 
+	freepage = subpage_release(pr, ptraddr);
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	spinlock_release(&kmalloc_spinlock);
+	if (freepage != 0) {
+		free_kpages(freepage);
+	}
+
+#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+#endif
+
+	return 0;
+}
+
+//
+////////////////////////////////////////////////////////////
+//
+// Per-cpu block caches.
+//
+// Each cpu keeps up to KHEAP_PCPU_BLOCKS free blocks of each size,
+// taken off (or not yet put back on) their heap pages. Each cache has
+// its own spinlock, which only its cpu takes, except when
+// kheap_reclaim empties every cache; the heap pages are locked only
+// to move KHEAP_PCPU_BATCH blocks at a time in or out. A block being
+// freed is recognized by the pageref recorded for its page in the
+// coremap, which needs no lock.
+//
+
+void
+kheap_pcpu_init(struct kheap_pcpu *kp)
+{
+	unsigned i;
+
+	spinlock_init(&kp->kp_lock);
+	for (i=0; i<KHEAP_NSIZES; i++) {
+		kp->kp_count[i] = 0;
+	}
+	kp->kp_hits = 0;
+	kp->kp_misses = 0;
+	kp->kp_refills = 0;
+	kp->kp_drains = 0;
+
+	/* Sample the first allocation, then at random intervals. */
+	kp->kp_sampleskip = 1;
+	kp->kp_samplerand = 0x9e3779b9U ^ (uint32_t)(vaddr_t)kp;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	kp->kp_next = kheap_pcpus;
+	kheap_pcpus = kp;
+	spinlock_release(&kmalloc_spinlock);
+}
+
+#ifdef PCPU_CACHE
+
+/*
+ * Move up to KHEAP_PCPU_BATCH free blocks of type BLKTYPE from the
+ * heap pages into KP. Doesn't add pages. Call with KP's lock held.
+ */
+static
+void
+pcpu_refill(struct kheap_pcpu *kp, unsigned blktype)
+{
+	struct pageref *pr;
+	unsigned n;
+
+	KASSERT(spinlock_do_i_hold(&kp->kp_lock));
+
+	n = 0;
+	spinlock_acquire(&kmalloc_spinlock);
+	while (n < KHEAP_PCPU_BATCH &&
+	       (pr = subpage_getpage(blktype)) != NULL) {
+		KASSERT(PR_BLOCKTYPE(pr) == blktype);
+		KASSERT(kp->kp_count[blktype] < KHEAP_PCPU_BLOCKS);
+		kp->kp_blocks[blktype][kp->kp_count[blktype]++] =
+			subpage_take(pr);
+		n++;
+	}
+	spinlock_release(&kmalloc_spinlock);
+	kp->kp_refills++;
+}
+
+/*
+ * Give up to NBLOCKS blocks of type BLKTYPE from KP back to their
+ * pages, and free any pages that leaves empty. Call with KP's lock
+ * held.
+ */
+static
+void
+pcpu_drain(struct kheap_pcpu *kp, unsigned blktype, unsigned nblocks)
+{
+	vaddr_t freepages[KHEAP_PCPU_BATCH];
+	struct pageref *pr;
+	vaddr_t ptraddr;
+	unsigned i, nfree;
+
+	KASSERT(spinlock_do_i_hold(&kp->kp_lock));
+	KASSERT(nblocks <= KHEAP_PCPU_BATCH);
+
+	nfree = 0;
+	spinlock_acquire(&kmalloc_spinlock);
+	while (nblocks > 0 && kp->kp_count[blktype] > 0) {
+		ptraddr = (vaddr_t)kp->kp_blocks[blktype][--kp->kp_count[blktype]];
+		pr = subpage_lookup(ptraddr);
+		KASSERT(pr != NULL);
+		KASSERT(PR_BLOCKTYPE(pr) == blktype);
+		freepages[nfree] = subpage_release(pr, ptraddr);
+		if (freepages[nfree] != 0) {
+			nfree++;
+		}
+		nblocks--;
+	}
+	spinlock_release(&kmalloc_spinlock);
+	kp->kp_drains++;
+
+	for (i=0; i<nfree; i++) {
+		free_kpages(freepages[i]);
+	}
+}
+
+/*
+ * Allocate a block of type BLKTYPE from this cpu's cache, refilling
+ * the cache if it's empty. Returns NULL if no heap page has a free
+ * block of that size; subpage_kmalloc then adds one.
+ */
+static
+void *
+pcpu_kmalloc(unsigned blktype)
+{
+	struct kheap_pcpu *kp;
+	void *ptr;
+	int spl;
+
+	spl = splhigh();
+	kp = &curcpu->c_self->c_heapcache;
+	spinlock_acquire(&kp->kp_lock);
+	if (kp->kp_count[blktype] > 0) {
+		kp->kp_hits++;
+	}
+	else {
+		kp->kp_misses++;
+		pcpu_refill(kp, blktype);
+		if (kp->kp_count[blktype] == 0) {
+			spinlock_release(&kp->kp_lock);
+			splx(spl);
+			return NULL;
+		}
+	}
+	ptr = kp->kp_blocks[blktype][--kp->kp_count[blktype]];
+	spinlock_release(&kp->kp_lock);
+	splx(spl);
+
+	return ptr;
+}
+
+/*
+ * Return a block to this cpu's cache, draining part of the cache
+ * first if it's full. Returns -1 if PTR is not on a subpage heap page
+ * known to the coremap.
+ */
+static
+int
+pcpu_kfree(void *ptr)
+{
+	struct kheap_pcpu *kp;
+	struct pageref *pr;
+	vaddr_t ptraddr;
+	unsigned blktype;
+	int spl;
+
 	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
+	 * We own a block on the page, so the page and its pageref
+	 * can't go away, and its block type doesn't change.
 	 */
+	ptraddr = (vaddr_t)ptr;
+	pr = coremap_heapref(KVADDR_TO_PADDR(ptraddr & PAGE_FRAME));
+	if (pr == NULL) {
+		return -1;
+	}
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype < NSIZES);
 
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	/* Check for proper alignment */
+	if (ptraddr % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
 
-		/* this block should not already be on the free list! */
-#ifdef SLOW
-		{
-			struct freelist *fl2;
+	/* Same as subpage_kfree. */
+	fill_deadbeef(ptr, sizes[blktype]);
 
-			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
-				KASSERT(fl2 != fl);
+	spl = splhigh();
+	kp = &curcpu->c_self->c_heapcache;
+	spinlock_acquire(&kp->kp_lock);
+	if (kp->kp_count[blktype] == KHEAP_PCPU_BLOCKS) {
+		pcpu_drain(kp, blktype, KHEAP_PCPU_BATCH);
+	}
+	kp->kp_blocks[blktype][kp->kp_count[blktype]++] = ptr;
+	spinlock_release(&kp->kp_lock);
+	splx(spl);
+
+	return 0;
+}
+
+/*
+ * Give back every block in every cpu's cache. Caches are never
+ * removed from the list, so it can be walked without
+ * kmalloc_spinlock, which we can't hold while taking a cache's lock.
+ */
+static
+void
+pcpu_drainall(void)
+{
+	struct kheap_pcpu *kp;
+	unsigned i;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	kp = kheap_pcpus;
+	spinlock_release(&kmalloc_spinlock);
+
+	for (; kp != NULL; kp = kp->kp_next) {
+		spinlock_acquire(&kp->kp_lock);
+		for (i=0; i<NSIZES; i++) {
+			while (kp->kp_count[i] > 0) {
+				pcpu_drain(kp, i, KHEAP_PCPU_BATCH);
 			}
 		}
-#else
-		/* check just the head */
-		KASSERT(fl != fl->next);
+		spinlock_release(&kp->kp_lock);
+	}
+}
+
+#endif /* PCPU_CACHE */
+
+/*
+ * Give back every heap page with nothing allocated on it, the per-size
+ * reserves included, and every pageref page with no pagerefs in use.
+ * Every cpu's block cache is emptied first, so blocks cached anywhere
+ * don't keep their pages. Returns the number of pages freed.
+ */
+unsigned
+kheap_reclaim(void)
+{
+	struct pagerefpage **pp, *page;
+	struct pageref *pr;
+	vaddr_t prpage, freelist, next;
+	unsigned i, n;
+
+	if (!kheap_tagged) {
+		/* No coremap yet, so nothing can be freed. */
+		return 0;
+	}
+
+#ifdef PCPU_CACHE
+	pcpu_drainall();
 #endif
+
+	/*
+	 * Chain the pages together through their first words, which
+	 * nobody is using any more, and free them after unlocking.
+	 */
+	freelist = 0;
+	n = 0;
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+	for (i=0; i<NSIZES; i++) {
+		while ((pr = emptybases[i]) != NULL) {
+			pagelist_remove(&emptybases[i], pr);
+			KASSERT(nempty[i] > 0);
+			nempty[i]--;
+			prpage = PR_PAGEADDR(pr);
+			freepageref(pr);
+			coremap_setheapref(KVADDR_TO_PADDR(prpage), NULL);
+			*(vaddr_t *)prpage = freelist;
+			freelist = prpage;
+			n++;
+		}
 	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
+	pp = &pagerefpages;
+	while ((page = *pp) != NULL) {
+		if (page->numinuse > 0) {
+			pp = &page->next;
+			continue;
+		}
+		*pp = page->next;
+		KASSERT(npagerefpages > 0);
+		npagerefpages--;
+		*(vaddr_t *)page = freelist;
+		freelist = (vaddr_t)page;
+		n++;
+	}
+	kheap_nreclaimed += n;
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
 
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+	while (freelist != 0) {
+		next = *(vaddr_t *)freelist;
+		free_kpages(freelist);
+		freelist = next;
+	}
+	return n;
+}
+
+//
+////////////////////////////////////////////////////////////
+//
+// Object caches.
+//
+// A cache carves whole pages ("slabs") into objects of exactly one
+// size, rounded up only to KMEM_ALIGN. Each slab page starts with a
+// struct kmem_slab, followed by a free-chain index per object, and
+// then the objects themselves, so the slab for an object is found by
+// rounding its address down to the page. Objects are constructed when
+// their slab is made and only destroyed when it is given back, so a
+// free object keeps its constructed state; the free chain lives
+// outside the objects so as not to disturb it.
+//
+// Slabs with free objects are kept on kc_slabs; full ones are on no
+// list. Up to KMEM_EMPTY_SLABS entirely free slabs are kept per cache
+// to absorb bursts; further ones are destroyed.
+//
+
+#define KMEM_ALIGN		8	/* object alignment */
+#define KMEM_MAXSIZE		(PAGE_SIZE / 2)	/* largest object */
+#define KMEM_EMPTY_SLABS	1	/* free slabs kept per cache */
+#define KMEM_NOOBJ		0xffff	/* ends a slab's free chain */
+
+#define KMEM_ROUNDUP(x)	(((x) + KMEM_ALIGN - 1) & ~(size_t)(KMEM_ALIGN - 1))
+
+struct kmem_slab {
+	struct kmem_slab *ks_next;	/* on kc_slabs, if not full */
+	struct kmem_slab *ks_prev;
+	struct kmem_cache *ks_cache;	/* owner */
+	uint16_t ks_nfree;		/* free objects */
+	uint16_t ks_freehead;		/* first free object, or KMEM_NOOBJ */
+	uint16_t ks_freenext[];		/* next free object after each one */
+};
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;			/* object size, rounded to KMEM_ALIGN */
+	size_t kc_offset;		/* offset of object 0 in a slab */
+	unsigned kc_perslab;		/* objects per slab */
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+
+	struct spinlock kc_lock;	/* protects the rest */
+	struct kmem_slab *kc_slabs;	/* slabs with free objects */
+	unsigned kc_nslabs;		/* all slabs */
+	unsigned kc_nempty;		/* slabs with nothing allocated */
+	unsigned kc_inuse;		/* objects handed out */
+	unsigned kc_hits;		/* allocations from existing slabs */
+	unsigned kc_misses;		/* allocations that made a slab */
+
+	struct kmem_cache *kc_next;	/* all caches, under kmalloc_spinlock */
+};
+
+#define KMEM_OBJ(kc, ks, i) \
+	((void *)((vaddr_t)(ks) + (kc)->kc_offset + (i) * (kc)->kc_size))
+
+static struct kmem_cache *kmem_caches;	/* all caches, for stats */
+
+/*
+ * Get a page and construct a slab's worth of objects on it. Call
+ * without any spinlocks held, as the constructor may allocate.
+ * Returns NULL if out of memory or if a constructor fails.
+ */
+static
+struct kmem_slab *
+kmem_slab_create(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	vaddr_t page;
+	unsigned i;
+	int result;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+	ks = (struct kmem_slab *)page;
+	ks->ks_next = ks->ks_prev = NULL;
+	ks->ks_cache = kc;
+
+	for (i=0; i<kc->kc_perslab; i++) {
+		if (kc->kc_ctor != NULL) {
+			result = kc->kc_ctor(KMEM_OBJ(kc, ks, i));
+			if (result) {
+				while (kc->kc_dtor != NULL && i-- > 0) {
+					kc->kc_dtor(KMEM_OBJ(kc, ks, i));
+				}
+				free_kpages(page);
+				return NULL;
+			}
+		}
+		ks->ks_freenext[i] = i + 1 < kc->kc_perslab ? i + 1 : KMEM_NOOBJ;
+	}
+	ks->ks_freehead = 0;
+	ks->ks_nfree = kc->kc_perslab;
+	return ks;
+}
+
+/*
+ * Destroy the objects on a slab that has none in use, and give back
+ * its page. Call without any spinlocks held.
+ */
+static
+void
+kmem_slab_destroy(struct kmem_cache *kc, struct kmem_slab *ks)
+{
+	unsigned i;
+
+	KASSERT(ks->ks_cache == kc);
+	KASSERT(ks->ks_nfree == kc->kc_perslab);
+
+	if (kc->kc_dtor != NULL) {
+		for (i=0; i<kc->kc_perslab; i++) {
+			kc->kc_dtor(KMEM_OBJ(kc, ks, i));
+		}
+	}
+	ks->ks_cache = NULL;
+	free_kpages((vaddr_t)ks);
+}
+
+/*
+ * Put KS at the head of KC's list of slabs with free objects.
+ */
+static
+void
+kmem_slab_link(struct kmem_cache *kc, struct kmem_slab *ks)
+{
+	KASSERT(spinlock_do_i_hold(&kc->kc_lock));
+
+	ks->ks_prev = NULL;
+	ks->ks_next = kc->kc_slabs;
+	if (kc->kc_slabs != NULL) {
+		kc->kc_slabs->ks_prev = ks;
+	}
+	kc->kc_slabs = ks;
+}
+
+static
+void
+kmem_slab_unlink(struct kmem_cache *kc, struct kmem_slab *ks)
+{
+	KASSERT(spinlock_do_i_hold(&kc->kc_lock));
+
+	if (ks->ks_prev != NULL) {
+		ks->ks_prev->ks_next = ks->ks_next;
 	}
 	else {
-		spinlock_release(&kmalloc_spinlock);
+		KASSERT(kc->kc_slabs == ks);
+		kc->kc_slabs = ks->ks_next;
 	}
+	if (ks->ks_next != NULL) {
+		ks->ks_next->ks_prev = ks->ks_prev;
+	}
+	ks->ks_next = ks->ks_prev = NULL;
+}
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size,
+		  int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct kmem_cache *kc;
+	unsigned n;
+
+	KASSERT(size > 0 && size <= KMEM_MAXSIZE);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	kc->kc_name = name;
+	kc->kc_size = KMEM_ROUNDUP(size);
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+
+	/* Fit as many objects, with their free-chain slots, as we can. */
+	n = (PAGE_SIZE - sizeof(struct kmem_slab)) /
+		(kc->kc_size + sizeof(uint16_t));
+	while (KMEM_ROUNDUP(sizeof(struct kmem_slab) + n * sizeof(uint16_t))
+	       + n * kc->kc_size > PAGE_SIZE) {
+		n--;
+	}
+	KASSERT(n > 0 && n < KMEM_NOOBJ);
+	kc->kc_perslab = n;
+	kc->kc_offset = KMEM_ROUNDUP(sizeof(struct kmem_slab) +
+				     n * sizeof(uint16_t));
+
+	spinlock_init(&kc->kc_lock);
+	kc->kc_slabs = NULL;
+	kc->kc_nslabs = 0;
+	kc->kc_nempty = 0;
+	kc->kc_inuse = 0;
+	kc->kc_hits = 0;
+	kc->kc_misses = 0;
 
-#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
 	spinlock_acquire(&kmalloc_spinlock);
-	checksubpages();
+	kc->kc_next = kmem_caches;
+	kmem_caches = kc;
 	spinlock_release(&kmalloc_spinlock);
-#endif
 
-	return 0;
+	return kc;
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_cache **kcp;
+	struct kmem_slab *ks;
+
+	KASSERT(kc->kc_inuse == 0);
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (kcp = &kmem_caches; *kcp != kc; kcp = &(*kcp)->kc_next) {
+		KASSERT(*kcp != NULL);
+	}
+	*kcp = kc->kc_next;
+	spinlock_release(&kmalloc_spinlock);
+
+	/* Nobody else can be using it now, so no locking. */
+	while ((ks = kc->kc_slabs) != NULL) {
+		kc->kc_slabs = ks->ks_next;
+		kmem_slab_destroy(kc, ks);
+	}
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	unsigned i;
+
+	spinlock_acquire(&kc->kc_lock);
+	if (kc->kc_slabs != NULL) {
+		kc->kc_hits++;
+	}
+	else {
+		kc->kc_misses++;
+		spinlock_release(&kc->kc_lock);
+		ks = kmem_slab_create(kc);
+		if (ks == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&kc->kc_lock);
+		kmem_slab_link(kc, ks);
+		kc->kc_nslabs++;
+		kc->kc_nempty++;
+	}
+
+	ks = kc->kc_slabs;
+	KASSERT(ks->ks_nfree > 0);
+	if (ks->ks_nfree == kc->kc_perslab) {
+		KASSERT(kc->kc_nempty > 0);
+		kc->kc_nempty--;
+	}
+	i = ks->ks_freehead;
+	KASSERT(i < kc->kc_perslab);
+	ks->ks_freehead = ks->ks_freenext[i];
+	ks->ks_nfree--;
+	if (ks->ks_nfree == 0) {
+		kmem_slab_unlink(kc, ks);
+	}
+	kc->kc_inuse++;
+	spinlock_release(&kc->kc_lock);
+
+	return KMEM_OBJ(kc, ks, i);
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_slab *ks, *freeslab;
+	vaddr_t offset;
+	unsigned i;
+
+	KASSERT(obj != NULL);
+	ks = (struct kmem_slab *)((vaddr_t)obj & PAGE_FRAME);
+	KASSERT(ks->ks_cache == kc);
+
+	offset = (vaddr_t)obj - (vaddr_t)ks;
+	if (offset < kc->kc_offset ||
+	    (offset - kc->kc_offset) % kc->kc_size != 0) {
+		panic("kmem_cache_free: %s: invalid object %p\n",
+		      kc->kc_name, obj);
+	}
+	i = (offset - kc->kc_offset) / kc->kc_size;
+	KASSERT(i < kc->kc_perslab);
+
+	freeslab = NULL;
+	spinlock_acquire(&kc->kc_lock);
+	if (ks->ks_nfree == 0) {
+		kmem_slab_link(kc, ks);
+	}
+	/* check just the head for a double free */
+	KASSERT(ks->ks_freehead != i);
+	ks->ks_freenext[i] = ks->ks_freehead;
+	ks->ks_freehead = i;
+	ks->ks_nfree++;
+	KASSERT(kc->kc_inuse > 0);
+	kc->kc_inuse--;
+
+	if (ks->ks_nfree == kc->kc_perslab) {
+		if (kc->kc_nempty < KMEM_EMPTY_SLABS) {
+			kc->kc_nempty++;
+		}
+		else {
+			kmem_slab_unlink(kc, ks);
+			kc->kc_nslabs--;
+			freeslab = ks;
+		}
+	}
+	spinlock_release(&kc->kc_lock);
+
+	if (freeslab != NULL) {
+		kmem_slab_destroy(kc, freeslab);
+	}
+}
+
+/*
+ * Print the object caches. Call with kmalloc_spinlock held.
+ */
+static
+void
+kmem_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	kprintf("Object caches:\n");
+	kprintf("  %-12s %5s %5s %6s %6s %8s %8s %4s\n", "name", "size",
+		"slab", "slabs", "inuse", "hits", "misses", "hit");
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		/* these are racy, but only counters */
+		kprintf("  %-12s %5lu %5u %6u %6u %8u %8u %3u%%\n",
+			kc->kc_name, (unsigned long)kc->kc_size,
+			kc->kc_perslab, kc->kc_nslabs, kc->kc_inuse,
+			kc->kc_hits, kc->kc_misses,
+			kc->kc_hits + kc->kc_misses == 0 ? 0 :
+			(100 * kc->kc_hits) / (kc->kc_hits + kc->kc_misses));
+	}
+}
+
+//
+////////////////////////////////////////////////////////////
+//
+// Allocation profiler.
+//
+// On average one kmalloc in kprof_rate is sampled: its call site,
+// size, and address are recorded until it is kfree'd, and the live
+// sampled bytes are added up per call site. Multiplying by the rate
+// then estimates how much of the heap each site is holding. The
+// distance to the next sample is picked at random (uniformly, with
+// the right mean) so that allocation patterns with a period can't
+// hide from it.
+//
+// Everything is in fixed tables. Samples are found again at kfree
+// time through a hash on their address; kfree first peeks at the
+// hash bucket without locking, so frees of unsampled blocks usually
+// cost only that. (A block being freed was handed out, and so
+// recorded, before whoever is freeing it got hold of it.) If the
+// tables fill up, further samples are dropped and counted.
+//
+// The call site is kmalloc's return address, so allocations made
+// through wrappers such as kstrdup are charged to the wrapper.
+//
+
+#define KPROF_RATE		64	/* default allocations per sample */
+#define KPROF_MAXLIVE		512	/* live samples */
+#define KPROF_HASHBITS		8
+#define KPROF_NBUCKETS		(1 << KPROF_HASHBITS)
+#define KPROF_NSITES		256	/* call sites */
+#define KPROF_TOP		20	/* sites printed */
+
+#define KPROF_HASH(ptr) \
+	((((vaddr_t)(ptr) >> 4) * 2654435761U) >> (32 - KPROF_HASHBITS))
+#define KPROF_SITEHASH(site) \
+	((((vaddr_t)(site) >> 2) * 2654435761U) % KPROF_NSITES)
+
+struct kprof_sample {
+	struct kprof_sample *ks_next;	/* in hash bucket, or free */
+	void *ks_ptr;			/* block allocated */
+	size_t ks_size;			/* size asked for */
+	unsigned ks_site;		/* index into kprof_sites[] */
+};
+
+struct kprof_site {
+	vaddr_t site;			/* call site, or 0 if slot unused */
+	unsigned nlive;			/* sampled blocks not yet freed */
+	size_t livebytes;		/* their total size */
+	unsigned nsampled;		/* samples ever taken here */
+};
+
+static struct spinlock kprof_lock = SPINLOCK_INITIALIZER;
+static unsigned kprof_rate = KPROF_RATE;
+static struct kprof_sample kprof_samples[KPROF_MAXLIVE];
+static struct kprof_sample *kprof_freesamples;
+static struct kprof_sample *kprof_buckets[KPROF_NBUCKETS];
+static struct kprof_site kprof_sites[KPROF_NSITES];
+static unsigned kprof_nlive;		/* samples in kprof_buckets[] */
+static unsigned kprof_dropped;		/* samples there was no room for */
+static bool kprof_ready;		/* kprof_freesamples is set up */
+
+/*
+ * Throw away the whole profile. Call with kprof_lock held.
+ */
+static
+void
+kprof_clear(void)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&kprof_lock));
+
+	kprof_freesamples = NULL;
+	for (i=0; i<KPROF_MAXLIVE; i++) {
+		kprof_samples[i].ks_next = kprof_freesamples;
+		kprof_freesamples = &kprof_samples[i];
+	}
+	for (i=0; i<KPROF_NBUCKETS; i++) {
+		kprof_buckets[i] = NULL;
+	}
+	for (i=0; i<KPROF_NSITES; i++) {
+		kprof_sites[i].site = 0;
+		kprof_sites[i].nlive = 0;
+		kprof_sites[i].livebytes = 0;
+		kprof_sites[i].nsampled = 0;
+	}
+	kprof_nlive = 0;
+	kprof_dropped = 0;
+	kprof_ready = true;
+}
+
+/*
+ * Pick the number of allocations until the next sample: uniformly
+ * from 1 to 2*RATE-1, which averages RATE.
+ */
+static
+unsigned
+kprof_skip(struct kheap_pcpu *kp, unsigned rate)
+{
+	uint32_t x;
+
+	/* xorshift32 */
+	x = kp->kp_samplerand;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	kp->kp_samplerand = x;
+
+	return 1 + x % (2 * rate - 1);
+}
+
+/*
+ * Count an allocation, and return true if it's the one to sample.
+ * Needs no lock: if this thread migrates halfway through, the worst
+ * that happens is a sample taken a little early or late.
+ */
+static
+bool
+kprof_tick(void)
+{
+	struct kheap_pcpu *kp;
+	unsigned rate;
+
+	rate = kprof_rate;
+	if (rate == 0 || !CURCPU_EXISTS()) {
+		return false;
+	}
+	kp = &curcpu->c_self->c_heapcache;
+	if (kp->kp_sampleskip > 1) {
+		kp->kp_sampleskip--;
+		return false;
+	}
+	kp->kp_sampleskip = kprof_skip(kp, rate);
+	return true;
+}
+
+/*
+ * Record the allocation of SIZE bytes at PTR from call site SITE.
+ */
+static
+void
+kprof_alloc(void *ptr, size_t size, vaddr_t site)
+{
+	struct kprof_sample *ks;
+	unsigned i, n;
+
+	spinlock_acquire(&kprof_lock);
+	if (!kprof_ready) {
+		kprof_clear();
+	}
+
+	/* Find the call site's slot, or an empty one for it. */
+	i = KPROF_SITEHASH(site);
+	for (n=0; n<KPROF_NSITES; n++) {
+		if (kprof_sites[i].site == site || kprof_sites[i].site == 0) {
+			break;
+		}
+		i = (i + 1) % KPROF_NSITES;
+	}
+	ks = kprof_freesamples;
+	if (n == KPROF_NSITES || ks == NULL) {
+		kprof_dropped++;
+		spinlock_release(&kprof_lock);
+		return;
+	}
+	kprof_freesamples = ks->ks_next;
+
+	kprof_sites[i].site = site;
+	kprof_sites[i].nlive++;
+	kprof_sites[i].livebytes += size;
+	kprof_sites[i].nsampled++;
+
+	ks->ks_ptr = ptr;
+	ks->ks_size = size;
+	ks->ks_site = i;
+	ks->ks_next = kprof_buckets[KPROF_HASH(ptr)];
+	kprof_buckets[KPROF_HASH(ptr)] = ks;
+	kprof_nlive++;
+	spinlock_release(&kprof_lock);
+}
+
+/*
+ * Forget PTR, which is being freed, if it was sampled. Must be
+ * called before the block is actually released, or it might be
+ * reallocated and sampled again first.
+ */
+static
+void
+kprof_free(void *ptr)
+{
+	struct kprof_sample **ksp, *ks;
+	struct kprof_site *site;
+
+	/* Unlocked peek; see above. */
+	if (kprof_buckets[KPROF_HASH(ptr)] == NULL) {
+		return;
+	}
+
+	spinlock_acquire(&kprof_lock);
+	for (ksp = &kprof_buckets[KPROF_HASH(ptr)]; (ks = *ksp) != NULL;
+	     ksp = &ks->ks_next) {
+		if (ks->ks_ptr == ptr) {
+			*ksp = ks->ks_next;
+			site = &kprof_sites[ks->ks_site];
+			KASSERT(site->nlive > 0);
+			KASSERT(site->livebytes >= ks->ks_size);
+			site->nlive--;
+			site->livebytes -= ks->ks_size;
+			ks->ks_next = kprof_freesamples;
+			kprof_freesamples = ks;
+			KASSERT(kprof_nlive > 0);
+			kprof_nlive--;
+			break;
+		}
+	}
+	spinlock_release(&kprof_lock);
+}
+
+/*
+ * Print the call sites holding the most sampled live bytes, with
+ * estimates of their share of the heap.
+ */
+void
+kheap_profile(void)
+{
+	struct kprof_site *ks, *best, *prev;
+	size_t totalbytes;
+	unsigned i, n, rate;
+
+	spinlock_acquire(&kprof_lock);
+	rate = kprof_rate;
+	totalbytes = 0;
+	for (i=0; i<KPROF_NSITES; i++) {
+		totalbytes += kprof_sites[i].livebytes;
+	}
+
+	kprintf("Heap profile: 1 in %u allocations sampled; "
+		"%u samples live, %u dropped\n", rate, kprof_nlive,
+		kprof_dropped);
+	kprintf("Estimated live heap: %lu bytes\n",
+		(unsigned long)(totalbytes * rate));
+	kprintf("  %10s %6s %8s  %s\n", "est. bytes", "live", "sampled",
+		"call site");
+
+	/*
+	 * Print in decreasing order of live bytes (ties by slot), by
+	 * finding each time the largest entry after the previous one.
+	 */
+	prev = NULL;
+	for (n=0; n<KPROF_TOP; n++) {
+		best = NULL;
+		for (i=0; i<KPROF_NSITES; i++) {
+			ks = &kprof_sites[i];
+			if (ks->site == 0 || ks->nlive == 0) {
+				continue;
+			}
+			if (prev != NULL &&
+			    (ks->livebytes > prev->livebytes ||
+			     (ks->livebytes == prev->livebytes &&
+			      ks <= prev))) {
+				continue;
+			}
+			if (best == NULL || ks->livebytes > best->livebytes) {
+				best = ks;
+			}
+		}
+		if (best == NULL) {
+			break;
+		}
+		kprintf("  %10lu %6u %8u  %p\n",
+			(unsigned long)(best->livebytes * rate), best->nlive,
+			best->nsampled, (void *)best->site);
+		prev = best;
+	}
+	spinlock_release(&kprof_lock);
+}
+
+void
+kheap_setprofrate(unsigned rate)
+{
+	spinlock_acquire(&kprof_lock);
+	kprof_rate = rate;
+	kprof_clear();
+	spinlock_release(&kprof_lock);
 }
 
 //
@@ -1170,17 +2311,15 @@ void *
 kmalloc(size_t sz)
 {
 	size_t checksz;
-#ifdef LABELS
 	vaddr_t label;
-#endif
+	void *ptr;
 
-#ifdef LABELS
+	/* The call site, for the profiler and for LABELS. */
 #ifdef __GNUC__
 	label = (vaddr_t)__builtin_return_address(0);
 #else
 #error "Don't know how to get return address with this compiler"
 #endif /* __GNUC__ */
-#endif /* LABELS */
 
 	checksz = sz + GUARD_OVERHEAD + LABEL_OVERHEAD;
 	if (checksz >= LARGEST_SUBPAGE_SIZE) {
@@ -1195,14 +2334,28 @@ kmalloc(size_t sz)
 		}
 		KASSERT(address % PAGE_SIZE == 0);
 
-		return (void *)address;
+		ptr = (void *)address;
 	}
-
+	else {
+		ptr = NULL;
+#ifdef PCPU_CACHE
+		if (CURCPU_EXISTS()) {
+			ptr = pcpu_kmalloc(blocktype(sz));
+		}
+#endif
+		if (ptr == NULL) {
 #ifdef LABELS
-	return subpage_kmalloc(sz, label);
+			ptr = subpage_kmalloc(sz, label);
 #else
-	return subpage_kmalloc(sz);
+			ptr = subpage_kmalloc(sz);
 #endif
+		}
+	}
+
+	if (ptr != NULL && kprof_tick()) {
+		kprof_alloc(ptr, sz, label);
+	}
+	return ptr;
 }
 
 /*
@@ -1216,7 +2369,14 @@ kfree(void *ptr)
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+	kprof_free(ptr);
+#ifdef PCPU_CACHE
+	if (CURCPU_EXISTS() && pcpu_kfree(ptr) == 0) {
+		return;
+	}
+#endif
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
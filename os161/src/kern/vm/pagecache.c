@@ -0,0 +1,132 @@
+#include <types.h>
+#include <lib.h>
+#include <vm.h>
+#include <pagecache.h>
+
+/*
+ * Page cache for file-backed mappings. See pagecache.h.
+ *
+ * Each entry is on two hash chains: one keyed by vnode and offset,
+ * for faults, and one keyed by frame, for pageout and unmapping,
+ * which start from a page table entry. The tables are fixed-size;
+ * there are never more entries than resident file pages.
+ */
+
+static struct pcentry *pagecache_byfile[PAGECACHE_NBUCKETS];
+static struct pcentry *pagecache_byframe[PAGECACHE_NBUCKETS];
+
+/* counters */
+static unsigned pagecache_nentries;
+static unsigned pagecache_nhits;
+static unsigned pagecache_nmisses;
+
+static
+unsigned
+pagecache_filehash(struct vnode *vn, off_t offset)
+{
+	uint32_t h;
+
+	h = (uint32_t)(uintptr_t)vn / sizeof(void *);
+	h ^= (uint32_t)(offset / PAGE_SIZE) * 2654435761U;
+	return h % PAGECACHE_NBUCKETS;
+}
+
+static
+unsigned
+pagecache_framehash(paddr_t paddr)
+{
+	return (paddr / PAGE_SIZE) % PAGECACHE_NBUCKETS;
+}
+
+struct pcentry *
+pagecache_lookup(struct vnode *vn, off_t offset)
+{
+	struct pcentry *pce;
+
+	KASSERT(offset % PAGE_SIZE == 0);
+
+	pce = pagecache_byfile[pagecache_filehash(vn, offset)];
+	for (; pce != NULL; pce = pce->pc_next) {
+		if (pce->pc_vnode == vn && pce->pc_offset == offset) {
+			pagecache_nhits++;
+			return pce;
+		}
+	}
+	pagecache_nmisses++;
+	return NULL;
+}
+
+struct pcentry *
+pagecache_bypaddr(paddr_t paddr)
+{
+	struct pcentry *pce;
+
+	pce = pagecache_byframe[pagecache_framehash(paddr)];
+	for (; pce != NULL; pce = pce->pc_pnext) {
+		if (pce->pc_paddr == paddr) {
+			return pce;
+		}
+	}
+	return NULL;
+}
+
+struct pcentry *
+pagecache_insert(struct vnode *vn, off_t offset, paddr_t paddr)
+{
+	struct pcentry *pce;
+	unsigned fh, ph;
+
+	KASSERT(offset % PAGE_SIZE == 0);
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	pce = kmalloc(sizeof(*pce));
+	if (pce == NULL) {
+		return NULL;
+	}
+	pce->pc_vnode = vn;
+	pce->pc_offset = offset;
+	pce->pc_paddr = paddr;
+	pce->pc_busy = true;
+
+	fh = pagecache_filehash(vn, offset);
+	ph = pagecache_framehash(paddr);
+	pce->pc_next = pagecache_byfile[fh];
+	pagecache_byfile[fh] = pce;
+	pce->pc_pnext = pagecache_byframe[ph];
+	pagecache_byframe[ph] = pce;
+
+	pagecache_nentries++;
+	return pce;
+}
+
+void
+pagecache_remove(struct pcentry *pce)
+{
+	struct pcentry **pp;
+
+	pp = &pagecache_byfile[pagecache_filehash(pce->pc_vnode,
+						  pce->pc_offset)];
+	while (*pp != pce) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->pc_next;
+	}
+	*pp = pce->pc_next;
+
+	pp = &pagecache_byframe[pagecache_framehash(pce->pc_paddr)];
+	while (*pp != pce) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->pc_pnext;
+	}
+	*pp = pce->pc_pnext;
+
+	KASSERT(pagecache_nentries > 0);
+	pagecache_nentries--;
+	kfree(pce);
+}
+
+void
+pagecache_printstats(void)
+{
+	kprintf("pagecache: %u pages, %u hits, %u misses\n",
+		pagecache_nentries, pagecache_nhits, pagecache_nmisses);
+}
@@ -0,0 +1,66 @@
+#include <types.h>
+#include <lib.h>
+#include <vm.h>
+#include <pagetable.h>
+
+/*
+ * Two-level page tables. See pagetable.h.
+ *
+ * The directory and the second-level tables are each one page, so
+ * they come straight from alloc_kpages rather than kmalloc.
+ */
+
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+	unsigned i;
+
+	COMPILE_ASSERT(sizeof(struct pagetable) == PAGE_SIZE);
+
+	pt = (struct pagetable *)alloc_kpages(1);
+	if (pt == NULL) {
+		return NULL;
+	}
+	for (i=0; i<PT_NENTRIES; i++) {
+		pt->pt_dir[i] = NULL;
+	}
+	return pt;
+}
+
+void
+pt_destroy(struct pagetable *pt)
+{
+	unsigned i;
+
+	for (i=0; i<PT_NENTRIES; i++) {
+		if (pt->pt_dir[i] != NULL) {
+			free_kpages((vaddr_t)pt->pt_dir[i]);
+		}
+	}
+	free_kpages((vaddr_t)pt);
+}
+
+pte_t *
+pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create)
+{
+	pte_t *table;
+	unsigned di;
+
+	KASSERT(vaddr < USERSPACETOP);
+
+	di = PT_DIRINDEX(vaddr);
+	table = pt->pt_dir[di];
+	if (table == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		table = (pte_t *)alloc_kpages(1);
+		if (table == NULL) {
+			return NULL;
+		}
+		bzero(table, PAGE_SIZE);
+		pt->pt_dir[di] = table;
+	}
+	return &table[PT_TABINDEX(vaddr)];
+}
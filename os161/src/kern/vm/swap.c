@@ -0,0 +1,198 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <vm.h>
+#include <swap.h>
+
+/*
+ * Swap space. See swap.h.
+ *
+ * The bitmap and counters are protected by swap_lock. The device
+ * vnode does its own locking for I/O.
+ */
+
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+static struct vnode *swap_vnode;	/* set once; never cleared */
+static struct bitmap *swap_map;		/* in-use slots */
+static unsigned swap_nslots;
+static unsigned swap_nused;
+
+/* counters */
+static unsigned swap_npageouts;
+static unsigned swap_npageins;
+
+int
+swap_on(const char *devname)
+{
+	struct vnode *vn;
+	struct bitmap *map;
+	struct stat st;
+	unsigned nslots;
+	int result;
+
+	if (swap_enabled()) {
+		return EBUSY;
+	}
+
+	result = vfs_swapon(devname, &vn);
+	if (result) {
+		return result;
+	}
+
+	result = VOP_STAT(vn, &st);
+	if (result) {
+		vfs_swapoff(devname);
+		return result;
+	}
+	nslots = st.st_size / PAGE_SIZE;
+	if (nslots == 0) {
+		vfs_swapoff(devname);
+		return ENOSPC;
+	}
+
+	map = bitmap_create(nslots);
+	if (map == NULL) {
+		vfs_swapoff(devname);
+		return ENOMEM;
+	}
+
+	spinlock_acquire(&swap_lock);
+	if (swap_vnode != NULL) {
+		/* lost a race with another swap_on */
+		spinlock_release(&swap_lock);
+		bitmap_destroy(map);
+		vfs_swapoff(devname);
+		return EBUSY;
+	}
+	swap_map = map;
+	swap_nslots = nslots;
+	swap_nused = 0;
+	swap_vnode = vn;
+	spinlock_release(&swap_lock);
+
+	kprintf("swap: %u pages (%uk) on %s\n", nslots,
+		nslots * (PAGE_SIZE / 1024), devname);
+	return 0;
+}
+
+bool
+swap_enabled(void)
+{
+	return swap_vnode != NULL;
+}
+
+int
+swap_alloc(unsigned *slot_ret)
+{
+	int result;
+
+	spinlock_acquire(&swap_lock);
+	if (swap_vnode == NULL) {
+		spinlock_release(&swap_lock);
+		return ENOSPC;
+	}
+	result = bitmap_alloc(swap_map, slot_ret);
+	if (result == 0) {
+		swap_nused++;
+	}
+	spinlock_release(&swap_lock);
+	return result;
+}
+
+void
+swap_free(unsigned slot)
+{
+	spinlock_acquire(&swap_lock);
+	KASSERT(slot < swap_nslots);
+	KASSERT(bitmap_isset(swap_map, slot));
+	bitmap_unmark(swap_map, slot);
+	swap_nused--;
+	spinlock_release(&swap_lock);
+}
+
+/*
+ * Move one page between memory and a swap slot.
+ */
+static
+int
+swap_io(paddr_t paddr, unsigned slot, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(swap_vnode != NULL);
+	KASSERT(slot < swap_nslots);
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &ku);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &ku);
+	}
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		/* short transfer */
+		return EIO;
+	}
+	return 0;
+}
+
+int
+swap_write(paddr_t paddr, unsigned slot)
+{
+	int result;
+
+	result = swap_io(paddr, slot, UIO_WRITE);
+	if (result == 0) {
+		spinlock_acquire(&swap_lock);
+		swap_npageouts++;
+		spinlock_release(&swap_lock);
+	}
+	return result;
+}
+
+int
+swap_read(paddr_t paddr, unsigned slot)
+{
+	int result;
+
+	result = swap_io(paddr, slot, UIO_READ);
+	if (result == 0) {
+		spinlock_acquire(&swap_lock);
+		swap_npageins++;
+		spinlock_release(&swap_lock);
+	}
+	return result;
+}
+
+void
+swap_printstats(void)
+{
+	unsigned nslots, nused, npageouts, npageins;
+
+	spinlock_acquire(&swap_lock);
+	nslots = swap_nslots;
+	nused = swap_nused;
+	npageouts = swap_npageouts;
+	npageins = swap_npageins;
+	spinlock_release(&swap_lock);
+
+	if (nslots == 0) {
+		kprintf("swap: not enabled\n");
+		return;
+	}
+	kprintf("swap: %u/%u slots in use\n", nused, nslots);
+	kprintf("swap: %u pageouts, %u pageins\n", npageouts, npageins);
+}
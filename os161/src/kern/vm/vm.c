@@ -0,0 +1,1074 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <mips/tlb.h>
+#include <addrspace.h>
+#include <pagetable.h>
+#include <pagecache.h>
+#include <coremap.h>
+#include <kheap.h>
+#include <swap.h>
+#include <vm.h>
+
+/*
+ * Paged VM system: fault handling and kernel page allocation.
+ *
+ * Translations live in each address space's page table (see
+ * addrspace.c and pagetable.c); the TLB is just a cache of it, loaded
+ * on demand by vm_fault. Pages inside a region that have never been
+ * touched have no frame at all until vm_fault zero-fills one.
+ *
+ * After fork, parent and child share frames: a page in a writable
+ * region whose entry lacks PTE_WRITE is copy-on-write, and the write
+ * fault (VM_FAULT_READONLY, or VM_FAULT_WRITE on a TLB miss) copies
+ * it.
+ *
+ * Once swap is enabled, a user page can be paged out when memory runs
+ * short: its entry then holds PTE_SWAPPED and the swap slot, and the
+ * next fault reads it back. Paging is serialized by vm_pagelock, which
+ * is held across any change to a page table entry that might race
+ * with eviction: faults, as_copy, as_destroy, and eviction itself.
+ * Frames being set up are pinned in the coremap so they cannot be
+ * chosen as victims before their entry is in place.
+ *
+ * The pageout thread doesn't hold vm_pagelock while it writes a page
+ * to swap, so faults elsewhere go on meanwhile. The victim's entry
+ * already holds its slot, marked PTE_BUSY, and its frame stays pinned;
+ * anything that finds a busy entry waits on vm_swapcv with
+ * vm_pagewait, the way faults on a page cache page being read wait on
+ * vm_filecv.
+ *
+ * Victims are chosen by the clock algorithm. The coremap_victim hand
+ * offers pages in physical order; a page used since the hand last
+ * passed it (PTE_NOREF clear) gets a second chance, and has PTE_NOREF
+ * set and its TLB entry revoked so that the next use faults and
+ * clears it again. Revocations that need TLB shootdowns on other cpus
+ * are batched until the victim's own, which is sent before the frame
+ * is written or reused. A page read back from swap keeps its slot (see
+ * coremap_swapslot) and is mapped read-only; until it is written it
+ * is clean and can be dropped without any I/O. The first write goes
+ * through the copy-on-write path, which finds the page unshared and
+ * just forgets the swap copy.
+ *
+ * Shared pages have no owner in the coremap and can't be paged out.
+ * When such a page is down to one mapping, that mapping becomes its
+ * owner again the next time it faults on it, or else when the clock
+ * reaches it: the coremap still knows the address every sharer used,
+ * and as_findowner looks for the address space mapping it there.
+ *
+ * The pageout thread keeps a reserve of free frames: allocating a
+ * user page below VM_PAGEOUT_LOWAT wakes it, and it pages out until
+ * there are VM_PAGEOUT_HIWAT free frames, so faults only rarely have
+ * to write pages out themselves.
+ *
+ * Reading a page that would be zero-filled doesn't allocate anything:
+ * it maps vm_zeropa, a single zeroed frame shared read-only by every
+ * such page (PTE_ZERO). The first write replaces it with a private
+ * zeroed frame. The zero page belongs to the kernel, so the clock
+ * never sees it and it is never freed.
+ *
+ * Likewise the page zeroing thread keeps the coremap's zero pool
+ * topped up, so that first-touch faults usually get a page that is
+ * already cleared instead of spending their time in bzero. It only
+ * works while memory is plentiful, and yields after every page.
+ *
+ * Pages of mmap'd files come from the page cache (pagecache.c): the
+ * first fault on a file page reads it into a frame and enters it in
+ * the cache, and later faults on the same page, from any address
+ * space, just map that frame; this is also how processes running the
+ * same program share its text. Such entries carry PTE_FILE and are
+ * never writable; writing to a private mapping goes through the
+ * copy-on-write path. The read happens without vm_pagelock, since the
+ * file system may itself fault on user memory; the entry is marked
+ * busy meanwhile and other faults on it wait on vm_filecv. An
+ * unshared file page is dropped without I/O when paged out, since it
+ * can always be read again. When a file is written, the cached pages
+ * it touched are read again in place (vm_filewritten), so mappings
+ * made later, and those already there, see the new contents.
+ *
+ * Only whole pages of file data go through the cache. The page where
+ * a region's file data (rg_filesz) ends, such as the one holding the
+ * start of an executable's bss, is read into a private frame and the
+ * rest of it zeroed; pages past it are zero-filled.
+ *
+ * A fault on a file page also maps whatever other pages of the same
+ * aligned window of vm_faultaround pages are already in the page
+ * cache ("fault-around"), so that a scan over a mapped file or
+ * program text takes one fault per window rather than one per page.
+ * Only the page table is filled in; the refill handler loads the TLB
+ * from it without a fault. Anonymous pages get no fault-around: ones
+ * that are resident are already in the page table.
+ */
+
+/* Default and largest fault-around window, in pages */
+#define VM_FAULTAROUND_DEFAULT	16
+#define VM_FAULTAROUND_MAX	64
+
+/* Free frame reserve maintained by the pageout thread */
+#define VM_PAGEOUT_LOWAT	16
+#define VM_PAGEOUT_HIWAT	32
+
+static struct lock *vm_pagelock;
+static struct cv *vm_pageout_cv;	/* pageout thread waits here */
+static bool vm_pageout_wanted;
+
+/* counters, protected by vm_pagelock */
+static unsigned vm_nrefs;		/* references noted by vm_fault */
+static unsigned vm_nsecondchances;	/* referenced pages passed over */
+static unsigned vm_nadopts;		/* unshared pages given back owners */
+static unsigned vm_ncleanouts;		/* clean pages dropped without I/O */
+static unsigned vm_nwriteouts;		/* dirty pages written out */
+static unsigned vm_nsyncouts;		/* ...of both, done by allocations */
+static unsigned vm_ndaemonouts;		/* ...of both, done by pageout */
+static unsigned vm_npageoutwakes;	/* times pageout was woken */
+static unsigned vm_nfileouts;		/* file pages dropped */
+static unsigned vm_nfilehits;		/* file faults found in cache */
+static unsigned vm_nfilereads;		/* file faults that read the file */
+static unsigned vm_nfilesteals;		/* cache frames made private */
+static unsigned vm_nfilerereads;	/* cached pages reread after writes */
+
+static struct cv *vm_filecv;		/* waiting for a page cache read */
+static struct cv *vm_swapcv;		/* waiting for a pageout write */
+
+static unsigned vm_faultaround = VM_FAULTAROUND_DEFAULT;
+static unsigned vm_naroundfaults;	/* faults that looked around */
+static unsigned vm_naroundpages;	/* pages they mapped */
+
+static paddr_t vm_zeropa;		/* the shared zero page */
+static unsigned vm_nzeromaps;		/* reads given the zero page */
+static unsigned vm_nzerocows;		/* ...later written */
+
+static struct cv *vm_zero_cv;		/* zeroing thread waits here */
+static bool vm_zero_wanted = true;	/* fill the pool at boot */
+
+static void vm_pageout_thread(void *, unsigned long);
+static void vm_zero_thread(void *, unsigned long);
+
+void
+vm_bootstrap(void)
+{
+	vaddr_t kva;
+	int result;
+
+	coremap_bootstrap();
+
+	vm_pagelock = lock_create("vm_pagelock");
+	if (vm_pagelock == NULL) {
+		panic("vm_bootstrap: Out of memory creating paging lock\n");
+	}
+	vm_pageout_cv = cv_create("pageout");
+	if (vm_pageout_cv == NULL) {
+		panic("vm_bootstrap: Out of memory creating pageout cv\n");
+	}
+
+	vm_zero_cv = cv_create("pagezero");
+	if (vm_zero_cv == NULL) {
+		panic("vm_bootstrap: Out of memory creating pagezero cv\n");
+	}
+
+	kva = alloc_kpages(1);
+	if (kva == 0) {
+		panic("vm_bootstrap: Out of memory allocating zero page\n");
+	}
+	bzero((void *)kva, PAGE_SIZE);
+	vm_zeropa = KVADDR_TO_PADDR(kva);
+
+	vm_filecv = cv_create("pagecache");
+	if (vm_filecv == NULL) {
+		panic("vm_bootstrap: Out of memory creating pagecache cv\n");
+	}
+	vm_swapcv = cv_create("pageout write");
+	if (vm_swapcv == NULL) {
+		panic("vm_bootstrap: Out of memory creating pageout cv\n");
+	}
+
+	result = thread_fork("pageout", NULL, vm_pageout_thread,
+			     NULL, 0, NULL);
+	if (result) {
+		panic("vm_bootstrap: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+	result = thread_fork("pagezero", NULL, vm_zero_thread,
+			     NULL, 0, NULL);
+	if (result) {
+		panic("vm_bootstrap: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+}
+
+void
+vm_pagelock_acquire(void)
+{
+	lock_acquire(vm_pagelock);
+}
+
+void
+vm_pagelock_release(void)
+{
+	lock_release(vm_pagelock);
+}
+
+/*
+ * Forget the swap copy of a page that is about to be written or
+ * shared, or is being freed. Call with vm_pagelock held.
+ */
+void
+vm_pagedirty(paddr_t pa)
+{
+	unsigned slot;
+
+	KASSERT(lock_do_i_hold(vm_pagelock));
+
+	slot = coremap_swapslot(pa);
+	if (slot != CME_NONE) {
+		coremap_setswapslot(pa, CME_NONE);
+		swap_free(slot);
+	}
+}
+
+/*
+ * Wait until the page of entry PTE isn't being written out. Call with
+ * vm_pagelock held; it is dropped while waiting. The page table must
+ * be one that can't go away meanwhile, i.e. the caller's own.
+ */
+void
+vm_pagewait(pte_t *pte)
+{
+	KASSERT(lock_do_i_hold(vm_pagelock));
+
+	while (*pte & PTE_BUSY) {
+		cv_wait(vm_swapcv, vm_pagelock);
+	}
+}
+
+/*
+ * Wait until the page cache page of entry PTE isn't being read (by
+ * vm_filewritten). As for vm_pagewait; the page may be dropped while
+ * we wait, leaving the entry empty.
+ */
+void
+vm_filewait(pte_t *pte)
+{
+	KASSERT(lock_do_i_hold(vm_pagelock));
+
+	while ((*pte & PTE_FILE) &&
+	       pagecache_bypaddr(*pte & PTE_FRAME)->pc_busy) {
+		cv_wait(vm_filecv, vm_pagelock);
+	}
+}
+
+/*
+ * Page out one user page, chosen by the clock. Call with vm_pagelock
+ * held. With UNLOCKED_IO, vm_pagelock is dropped while writing the
+ * page to swap, so the caller must not depend on anything it holds
+ * the lock to keep still.
+ */
+static
+int
+vm_evict(bool unlocked_io)
+{
+	struct addrspace *as;
+	struct tlbbatch tb;
+	vaddr_t vaddr;
+	paddr_t pa;
+	pte_t *pte, oldpte;
+	unsigned slot, tries, maxtries;
+	bool clean;
+	int result;
+
+	KASSERT(lock_do_i_hold(vm_pagelock));
+
+	vm_tlbbatch_init(&tb);
+
+	/* Two sweeps: the first may only clear reference bits. */
+	maxtries = 2 * coremap_totalpages();
+
+	for (tries=0; tries<maxtries; tries++) {
+		pa = coremap_victim(&as, &vaddr);
+		if (pa == 0) {
+			vm_tlbbatch_send(&tb);
+			return ENOMEM;
+		}
+		if (as == NULL) {
+			/* Formerly shared; see who maps it now. */
+			as = as_findowner(pa, vaddr);
+			if (as == NULL) {
+				/* Not at VADDR; leave it to vm_fault. */
+				coremap_setowner(pa, NULL, 0);
+				coremap_unpin(pa);
+				continue;
+			}
+			coremap_setowner(pa, as, vaddr);
+			vm_nadopts++;
+		}
+
+		pte = pt_lookup(as->as_pt, vaddr, false);
+		KASSERT(pte != NULL);
+		KASSERT((*pte & PTE_VALID) && (*pte & PTE_FRAME) == pa);
+
+		if (!(*pte & PTE_NOREF)) {
+			/* Used recently; give it a second chance. */
+			*pte |= PTE_NOREF;
+			vm_tlbrevoke(&as->as_tlb, vaddr, &tb);
+			coremap_unpin(pa);
+			vm_nsecondchances++;
+			continue;
+		}
+
+		if (*pte & PTE_FILE) {
+			/* Can be read from the file again. */
+			*pte = 0;
+			vm_tlbrevoke(&as->as_tlb, vaddr, &tb);
+			vm_tlbbatch_send(&tb);
+			pagecache_remove(pagecache_bypaddr(pa));
+			coremap_free(pa);
+			vm_nfileouts++;
+			return 0;
+		}
+
+		slot = coremap_swapslot(pa);
+		clean = slot != CME_NONE;
+		if (!clean) {
+			result = swap_alloc(&slot);
+			if (result) {
+				coremap_unpin(pa);
+				vm_tlbbatch_send(&tb);
+				return ENOMEM;
+			}
+		}
+
+		/*
+		 * Switch the entry over before revoking, so a refill
+		 * can't bring the old translation back, and make sure no
+		 * cpu can still write the page before copying it out.
+		 */
+		oldpte = *pte;
+		*pte = PTE_MKSWAP(slot);
+		vm_tlbrevoke(&as->as_tlb, vaddr, &tb);
+		vm_tlbbatch_send(&tb);
+
+		if (clean) {
+			/* The slot now belongs to the page table entry. */
+			coremap_setswapslot(pa, CME_NONE);
+			vm_ncleanouts++;
+		}
+		else {
+			if (unlocked_io) {
+				/* The frame stays pinned meanwhile. */
+				*pte |= PTE_BUSY;
+				lock_release(vm_pagelock);
+			}
+			result = swap_write(pa, slot);
+			if (unlocked_io) {
+				lock_acquire(vm_pagelock);
+				KASSERT(*pte == (PTE_MKSWAP(slot) | PTE_BUSY));
+				cv_broadcast(vm_swapcv, vm_pagelock);
+			}
+			if (result) {
+				*pte = oldpte;
+				swap_free(slot);
+				coremap_unpin(pa);
+				return result;
+			}
+			*pte = PTE_MKSWAP(slot);
+			vm_nwriteouts++;
+		}
+
+		coremap_free(pa);
+		return 0;
+	}
+	vm_tlbbatch_send(&tb);
+	return ENOMEM;
+}
+
+/*
+ * Pageout thread: whenever free memory drops below the low-water
+ * mark, page out until it is back above the high-water mark.
+ */
+static
+void
+vm_pageout_thread(void *unused1, unsigned long unused2)
+{
+	(void)unused1;
+	(void)unused2;
+
+	lock_acquire(vm_pagelock);
+	while (true) {
+		while (!vm_pageout_wanted) {
+			cv_wait(vm_pageout_cv, vm_pagelock);
+		}
+		vm_pageout_wanted = false;
+
+		/* Idle kernel heap pages are cheaper to get back. */
+		kheap_reclaim();
+
+		while (coremap_freepages() < VM_PAGEOUT_HIWAT) {
+			if (vm_evict(true)) {
+				/* Nothing left to page out, or no swap. */
+				break;
+			}
+			vm_ndaemonouts++;
+
+			/* Let faults in between pages. */
+			lock_release(vm_pagelock);
+			thread_yield();
+			lock_acquire(vm_pagelock);
+		}
+	}
+}
+
+/*
+ * Page zeroing thread: refill the zero pool whenever it runs low,
+ * unless memory is short.
+ */
+static
+void
+vm_zero_thread(void *unused1, unsigned long unused2)
+{
+	(void)unused1;
+	(void)unused2;
+
+	lock_acquire(vm_pagelock);
+	while (true) {
+		while (!vm_zero_wanted) {
+			cv_wait(vm_zero_cv, vm_pagelock);
+		}
+		vm_zero_wanted = false;
+		lock_release(vm_pagelock);
+
+		/* Don't use up pages the pageout thread is trying to free. */
+		while (coremap_freepages() > VM_PAGEOUT_HIWAT &&
+		       coremap_zerofill()) {
+			thread_yield();
+		}
+
+		lock_acquire(vm_pagelock);
+	}
+}
+
+/*
+ * Get a frame for user page VADDR in AS, paging something out if
+ * necessary. The frame comes back pinned; unpin it once the page
+ * table entry points at it. Returns 0 if out of memory.
+ */
+paddr_t
+vm_getpage(struct addrspace *as, vaddr_t vaddr)
+{
+	paddr_t pa;
+
+	KASSERT(lock_do_i_hold(vm_pagelock));
+
+	while ((pa = coremap_alloc(1, as, vaddr)) == 0) {
+		if (kheap_reclaim() > 0) {
+			continue;
+		}
+		if (!swap_enabled() || vm_evict(false) != 0) {
+			return 0;
+		}
+		vm_nsyncouts++;
+	}
+
+	if (swap_enabled() && !vm_pageout_wanted &&
+	    coremap_freepages() < VM_PAGEOUT_LOWAT) {
+		vm_pageout_wanted = true;
+		vm_npageoutwakes++;
+		cv_signal(vm_pageout_cv, vm_pagelock);
+	}
+	return pa;
+}
+
+/*
+ * Can a kernel allocation that found no memory page something out?
+ * Not from interrupts or with spinlocks held, since paging sleeps,
+ * nor with interrupts off, since it may wait for TLB shootdowns, and
+ * not from within the paging code itself.
+ */
+static
+bool
+vm_can_evict(void)
+{
+	return swap_enabled() && curthread != NULL &&
+		!curthread->t_in_interrupt && curcpu->c_spinlocks == 0 &&
+		curthread->t_curspl == 0 && !lock_do_i_hold(vm_pagelock);
+}
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t
+alloc_kpages(int npages)
+{
+	paddr_t pa;
+	int result;
+
+	pa = coremap_alloc(npages, NULL, 0);
+	if (pa == 0 && kheap_reclaim() > 0) {
+		pa = coremap_alloc(npages, NULL, 0);
+	}
+	if (pa == 0 && npages == 1 && vm_can_evict()) {
+		lock_acquire(vm_pagelock);
+		result = vm_evict(true);
+		if (result == 0) {
+			vm_nsyncouts++;
+		}
+		lock_release(vm_pagelock);
+		if (result == 0) {
+			pa = coremap_alloc(npages, NULL, 0);
+		}
+	}
+	if (pa == 0) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+void
+free_kpages(vaddr_t addr)
+{
+	coremap_free(KVADDR_TO_PADDR(addr));
+}
+
+/*
+ * First touch of a page: back it with a zeroed frame, from the zero
+ * pool if possible.
+ */
+static
+int
+vm_zerofill(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+	    pte_t *pte)
+{
+	paddr_t pa;
+
+	pa = coremap_alloc_zeroed(as, vaddr);
+	if (pa == 0) {
+		pa = vm_getpage(as, vaddr);
+		if (pa == 0) {
+			return ENOMEM;
+		}
+		bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+	}
+	if (!vm_zero_wanted &&
+	    coremap_zeropages() < COREMAP_ZEROPAGES / 2) {
+		vm_zero_wanted = true;
+		cv_signal(vm_zero_cv, vm_pagelock);
+	}
+
+	*pte = pa | PTE_VALID;
+	if (rg->rg_flags & RG_WRITE) {
+		*pte |= PTE_WRITE;
+	}
+	coremap_unpin(pa);
+	return 0;
+}
+
+/*
+ * Fault on a paged-out page: read it back in. It stays clean, with
+ * the slot recorded in the coremap, until it is written.
+ */
+static
+int
+vm_swapin(struct addrspace *as, vaddr_t vaddr, pte_t *pte)
+{
+	paddr_t pa;
+	unsigned slot;
+	int result;
+
+	slot = PTE_SLOT(*pte);
+
+	pa = vm_getpage(as, vaddr);
+	if (pa == 0) {
+		return ENOMEM;
+	}
+	result = swap_read(pa, slot);
+	if (result) {
+		coremap_free(pa);
+		return result;
+	}
+
+	coremap_setswapslot(pa, slot);
+	*pte = pa | PTE_VALID;
+	coremap_unpin(pa);
+	return 0;
+}
+
+/*
+ * Fault on a page of a mapped file: map the page cache's frame for
+ * it, reading it in first if it isn't cached yet. Drops vm_pagelock
+ * while reading.
+ */
+static
+int
+vm_filefault(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+	     pte_t *pte)
+{
+	struct pcentry *pce;
+	struct iovec iov;
+	struct uio ku;
+	paddr_t pa;
+	off_t offset;
+	int result;
+
+	offset = rg->rg_offset + (vaddr - rg->rg_vbase);
+
+	while ((pce = pagecache_lookup(rg->rg_vnode, offset)) != NULL &&
+	       pce->pc_busy) {
+		cv_wait(vm_filecv, vm_pagelock);
+	}
+	if (pce != NULL) {
+		if (*pte & PTE_VALID) {
+			/* Another thread of ours got here while we waited. */
+			return 0;
+		}
+		pa = pce->pc_paddr;
+		coremap_incref(pa, vaddr);
+		*pte = pa | PTE_VALID | PTE_FILE;
+		vm_nfilehits++;
+		return 0;
+	}
+
+	pa = vm_getpage(as, vaddr);
+	if (pa == 0) {
+		return ENOMEM;
+	}
+	pce = pagecache_insert(rg->rg_vnode, offset, pa);
+	if (pce == NULL) {
+		coremap_free(pa);
+		return ENOMEM;
+	}
+
+	lock_release(vm_pagelock);
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(pa), PAGE_SIZE,
+		  offset, UIO_READ);
+	result = VOP_READ(rg->rg_vnode, &ku);
+	lock_acquire(vm_pagelock);
+
+	pce->pc_busy = false;
+	cv_broadcast(vm_filecv, vm_pagelock);
+	if (result) {
+		pagecache_remove(pce);
+		coremap_free(pa);
+		return result;
+	}
+	/* Past end of file reads as zeros. */
+	bzero((char *)PADDR_TO_KVADDR(pa) + (PAGE_SIZE - ku.uio_resid),
+	      ku.uio_resid);
+	vm_nfilereads++;
+
+	KASSERT(*pte == 0);
+	*pte = pa | PTE_VALID | PTE_FILE;
+	coremap_unpin(pa);
+	return 0;
+}
+
+/*
+ * Fault on the page of RG where its file data ends: read what there
+ * is into a private frame and zero the rest. Drops vm_pagelock while
+ * reading, like vm_filefault.
+ */
+static
+int
+vm_filetail(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+	    pte_t *pte)
+{
+	struct iovec iov;
+	struct uio ku;
+	paddr_t pa;
+	size_t len;
+	int result;
+
+	len = rg->rg_filesz - (vaddr - rg->rg_vbase);
+	KASSERT(len < PAGE_SIZE);
+
+	pa = vm_getpage(as, vaddr);
+	if (pa == 0) {
+		return ENOMEM;
+	}
+
+	lock_release(vm_pagelock);
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(pa), len,
+		  rg->rg_offset + (vaddr - rg->rg_vbase), UIO_READ);
+	result = VOP_READ(rg->rg_vnode, &ku);
+	lock_acquire(vm_pagelock);
+
+	if (result) {
+		coremap_free(pa);
+		return result;
+	}
+	bzero((char *)PADDR_TO_KVADDR(pa) + (len - ku.uio_resid),
+	      PAGE_SIZE - (len - ku.uio_resid));
+	vm_nfilereads++;
+
+	KASSERT(*pte == 0);
+	*pte = pa | PTE_VALID;
+	if (rg->rg_flags & RG_WRITE) {
+		*pte |= PTE_WRITE;
+	}
+	coremap_unpin(pa);
+	return 0;
+}
+
+/*
+ * Fault-around: after a fault on file page VADDR of RG, map the
+ * neighbouring pages in its window that are in the page cache and
+ * not yet mapped here. Each one is a fault avoided if it gets used.
+ */
+static
+void
+vm_filearound(struct addrspace *as, struct region *rg, vaddr_t vaddr)
+{
+	struct pcentry *pce;
+	vaddr_t start, end, va;
+	pte_t *pte;
+	paddr_t pa;
+
+	KASSERT(lock_do_i_hold(vm_pagelock));
+
+	if (vm_faultaround <= 1) {
+		return;
+	}
+
+	start = vaddr - vaddr % (vm_faultaround * PAGE_SIZE);
+	end = start + vm_faultaround * PAGE_SIZE;
+	if (start < rg->rg_vbase) {
+		start = rg->rg_vbase;
+	}
+	/* Only whole pages of file data come from the cache. */
+	if (end > rg->rg_vbase + (rg->rg_filesz & PAGE_FRAME)) {
+		end = rg->rg_vbase + (rg->rg_filesz & PAGE_FRAME);
+	}
+
+	vm_naroundfaults++;
+	for (va = start; va < end; va += PAGE_SIZE) {
+		if (va == vaddr) {
+			continue;
+		}
+		/* Don't allocate page tables for pages we may not map. */
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte == NULL || *pte != 0) {
+			continue;
+		}
+		pce = pagecache_lookup(rg->rg_vnode,
+				       rg->rg_offset + (va - rg->rg_vbase));
+		if (pce == NULL || pce->pc_busy) {
+			continue;
+		}
+		pa = pce->pc_paddr;
+		coremap_incref(pa, va);
+		*pte = pa | PTE_VALID | PTE_FILE;
+		vm_naroundpages++;
+	}
+}
+
+/*
+ * LEN bytes at OFFSET of VN have just been written: read any of those
+ * pages that are in the page cache again, so the frames, which every
+ * mapping of them shares, match the file. As in vm_filefault, the
+ * read is done without vm_pagelock with the entry marked busy. The
+ * frame is pinned meanwhile so the clock passes it over, and whoever
+ * would unmap or take it waits for the entry first (vm_filewait).
+ */
+void
+vm_filewritten(struct vnode *vn, off_t offset, size_t len)
+{
+	struct pcentry *pce;
+	struct iovec iov;
+	struct uio ku;
+	off_t pos, end;
+	paddr_t pa;
+	int result;
+
+	if (len == 0) {
+		return;
+	}
+	end = offset + len;
+	lock_acquire(vm_pagelock);
+	for (pos = offset - offset % PAGE_SIZE; pos < end; pos += PAGE_SIZE) {
+		while ((pce = pagecache_lookup(vn, pos)) != NULL &&
+		       pce->pc_busy) {
+			cv_wait(vm_filecv, vm_pagelock);
+		}
+		if (pce == NULL) {
+			continue;
+		}
+		pa = pce->pc_paddr;
+		coremap_pin(pa);
+		pce->pc_busy = true;
+
+		lock_release(vm_pagelock);
+		uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(pa), PAGE_SIZE,
+			  pos, UIO_READ);
+		result = VOP_READ(vn, &ku);
+		lock_acquire(vm_pagelock);
+
+		if (result) {
+			kprintf("vm: rereading written file page: %s\n",
+				strerror(result));
+		}
+		else {
+			/* Past end of file reads as zeros. */
+			bzero((char *)PADDR_TO_KVADDR(pa) +
+			      (PAGE_SIZE - ku.uio_resid), ku.uio_resid);
+		}
+		pce->pc_busy = false;
+		cv_broadcast(vm_filecv, vm_pagelock);
+		coremap_unpin(pa);
+		vm_nfilerereads++;
+	}
+	lock_release(vm_pagelock);
+}
+
+/*
+ * Set the fault-around window to NPAGES pages, rounded down to a
+ * power of two; 0 or 1 turns fault-around off.
+ */
+void
+vm_setfaultaround(unsigned npages)
+{
+	unsigned n;
+
+	if (npages > VM_FAULTAROUND_MAX) {
+		npages = VM_FAULTAROUND_MAX;
+	}
+	for (n = 1; n * 2 <= npages; n *= 2) {
+		/* nothing */
+	}
+
+	lock_acquire(vm_pagelock);
+	vm_faultaround = npages == 0 ? 0 : n;
+	lock_release(vm_pagelock);
+}
+
+/*
+ * Write to a copy-on-write page. If we hold the only reference the
+ * page is simply made writable again; otherwise we take a private
+ * copy and drop our reference to the shared one. A clean page takes
+ * the same path and becomes dirty.
+ *
+ * Shared frames have no single owner and are never paged out; once
+ * we are the last reference we take ownership back, which makes the
+ * frame pageable again (if it hasn't been given back already). A page cache frame we alone map is taken out
+ * of the cache and becomes our private copy.
+ */
+static
+int
+vm_cowfault(struct addrspace *as, vaddr_t vaddr, pte_t *pte)
+{
+	paddr_t oldpa, newpa;
+
+	oldpa = *pte & PTE_FRAME;
+	if (coremap_refcount(oldpa) > 1) {
+		newpa = vm_getpage(as, vaddr);
+		if (newpa == 0) {
+			return ENOMEM;
+		}
+		memmove((void *)PADDR_TO_KVADDR(newpa),
+			(const void *)PADDR_TO_KVADDR(oldpa), PAGE_SIZE);
+		*pte = newpa | (*pte & ~(PTE_FRAME | PTE_FILE));
+		vm_tlbinvalidate(&as->as_tlb, vaddr);
+		coremap_free(oldpa);
+		coremap_unpin(newpa);
+	}
+	else {
+		if (*pte & PTE_FILE) {
+			pagecache_remove(pagecache_bypaddr(oldpa));
+			*pte &= ~PTE_FILE;
+			vm_nfilesteals++;
+		}
+		vm_pagedirty(oldpa);
+		coremap_setowner(oldpa, as, vaddr);
+	}
+	*pte |= PTE_WRITE;
+	return 0;
+}
+
+/*
+ * Write to a page mapped to the shared zero page: give it a private
+ * zeroed frame.
+ */
+static
+int
+vm_zerocow(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+	   pte_t *pte)
+{
+	pte_t oldpte;
+	int result;
+
+	oldpte = *pte;
+	*pte = 0;
+	result = vm_zerofill(as, rg, vaddr, pte);
+	if (result) {
+		*pte = oldpte;
+		return result;
+	}
+	vm_tlbinvalidate(&as->as_tlb, vaddr);
+	vm_nzerocows++;
+	return 0;
+}
+
+/*
+ * First touch of a page: fill it from the region's file, if it has
+ * one and the page is within its file data, or else with zeros. A
+ * read of a zero page just maps the shared zero page, except while
+ * load_elf runs, since it writes through read faults' mappings.
+ */
+static
+int
+vm_pagein(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+	  pte_t *pte, int faulttype)
+{
+	size_t pageoff;
+	int result;
+
+	pageoff = vaddr - rg->rg_vbase;
+	if (rg->rg_vnode == NULL || pageoff >= rg->rg_filesz) {
+		if (faulttype == VM_FAULT_READ && as->as_load_complete) {
+			*pte = vm_zeropa | PTE_VALID | PTE_ZERO;
+			vm_nzeromaps++;
+			return 0;
+		}
+		return vm_zerofill(as, rg, vaddr, pte);
+	}
+	if (pageoff + PAGE_SIZE > rg->rg_filesz) {
+		return vm_filetail(as, rg, vaddr, pte);
+	}
+
+	result = vm_filefault(as, rg, vaddr, pte);
+	if (result == 0) {
+		vm_filearound(as, rg, vaddr);
+	}
+	return result;
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct addrspace *as;
+	struct region *rg;
+	pte_t *pte;
+	uint32_t elo;
+	int result;
+
+	faultaddress &= PAGE_FRAME;
+
+	DEBUG(DB_VM, "vm: fault: 0x%x\n", faultaddress);
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	as = curthread->t_addrspace;
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably a kernel
+		 * fault early in boot. Return EFAULT so as to panic
+		 * instead of getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	rg = as_find_region(as, faultaddress);
+	if (rg == NULL) {
+		/* Maybe the stack needs to grow. */
+		rg = as_growstack(as, faultaddress);
+		if (rg == NULL) {
+			return EFAULT;
+		}
+	}
+
+	if (faulttype != VM_FAULT_READ && as->as_load_complete &&
+	    !(rg->rg_flags & RG_WRITE)) {
+		/* Write to a read-only region. */
+		return EFAULT;
+	}
+
+	lock_acquire(vm_pagelock);
+
+	while ((pte = pt_lookup(as->as_pt, faultaddress, true)) == NULL) {
+		/* No memory for a second-level table. */
+		if (!swap_enabled() || vm_evict(true) != 0) {
+			lock_release(vm_pagelock);
+			return ENOMEM;
+		}
+	}
+
+	/* The page may be on its way out, or being reread, right now. */
+	vm_pagewait(pte);
+	vm_filewait(pte);
+
+	result = 0;
+	if (*pte & PTE_SWAPPED) {
+		result = vm_swapin(as, faultaddress, pte);
+	}
+	else if (!(*pte & PTE_VALID)) {
+		result = vm_pagein(as, rg, faultaddress, pte, faulttype);
+	}
+	if (result == 0 && faulttype != VM_FAULT_READ &&
+	    (*pte & PTE_ZERO)) {
+		result = vm_zerocow(as, rg, faultaddress, pte);
+	}
+	else if (result == 0 && faulttype != VM_FAULT_READ &&
+	    (rg->rg_flags & RG_WRITE) && !(*pte & PTE_WRITE)) {
+		result = vm_cowfault(as, faultaddress, pte);
+	}
+	if (result) {
+		lock_release(vm_pagelock);
+		return result;
+	}
+
+	if (*pte & PTE_NOREF) {
+		/* Used again since the clock hand passed. */
+		*pte &= ~PTE_NOREF;
+		vm_nrefs++;
+	}
+	if (!(*pte & PTE_ZERO) && coremap_refcount(*pte & PTE_FRAME) == 1) {
+		/* If it was shared, it's ours alone now. */
+		coremap_adopt(*pte & PTE_FRAME, as, faultaddress);
+	}
+
+	elo = *pte & (PTE_FRAME | PTE_NOCACHE | PTE_WRITE | PTE_VALID);
+	if (!as->as_load_complete && !(*pte & (PTE_FILE | PTE_ZERO))) {
+		/* load_elf is still filling in read-only segments */
+		vm_pagedirty(*pte & PTE_FRAME);
+		elo |= TLBLO_DIRTY;
+	}
+
+	DEBUG(DB_VM, "vm: 0x%x -> 0x%x\n", faultaddress, elo & TLBLO_PPAGE);
+	vm_tlbload(faultaddress, elo);
+
+	lock_release(vm_pagelock);
+	return 0;
+}
+
+void
+vm_printstats(void)
+{
+	lock_acquire(vm_pagelock);
+	kprintf("vm: %u references noted, %u second chances, "
+		"%u formerly shared pages owned again\n",
+		vm_nrefs, vm_nsecondchances, vm_nadopts);
+	kprintf("vm: %u pageouts (%u clean, %u written): "
+		"%u by pageout thread, %u on demand\n",
+		vm_ncleanouts + vm_nwriteouts, vm_ncleanouts, vm_nwriteouts,
+		vm_ndaemonouts, vm_nsyncouts);
+	kprintf("vm: pageout thread woken %u times\n", vm_npageoutwakes);
+	kprintf("vm: file faults: %u cached, %u read; "
+		"%u made private, %u dropped\n",
+		vm_nfilehits, vm_nfilereads, vm_nfilesteals, vm_nfileouts);
+	kprintf("vm: %u cached file pages reread after writes\n",
+		vm_nfilerereads);
+	kprintf("vm: %u reads mapped the zero page, %u of them later "
+		"written\n", vm_nzeromaps, vm_nzerocows);
+	kprintf("vm: fault-around window %u pages: %u faults mapped %u "
+		"pages ahead\n",
+		vm_faultaround, vm_naroundfaults, vm_naroundpages);
+	lock_release(vm_pagelock);
+}